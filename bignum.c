@@ -0,0 +1,216 @@
+#include <string.h>
+#include <math.h>
+#include "bignum.h"
+
+typedef unsigned __int128 u128;
+
+static void trim(bignum *b) {
+    while (b->n && b->limb[b->n - 1] == 0)
+        b->n--;
+}
+
+void big_set_u64(bignum *b, uint64_t v) {
+    b->limb[0] = v;
+    b->n = v != 0;
+}
+
+// Decimal digits in [s, end) -> b; stops at the first non-digit like atoi.
+// 19 digits are folded into one limb multiply at a time.
+int big_from_dec(bignum *b, const char *s, const char *end) {
+    b->n = 0;
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        uint64_t chunk = 0, scale = 1;
+        for (int k = 0; k < 19 && s < end && *s >= '0' && *s <= '9'; k++) {
+            chunk = chunk * 10 + (*s++ - '0');
+            scale *= 10;
+        }
+
+        uint64_t carry = chunk;
+        for (int i = 0; i < b->n; i++) {
+            u128 t = (u128)b->limb[i] * scale + carry;
+            b->limb[i] = (uint64_t)t;
+            carry = t >> 64;
+        }
+        if (carry) {
+            if (b->n == BIG_LIMBS)
+                return -1;
+            b->limb[b->n++] = carry;
+        }
+    }
+    return 0;
+}
+
+// buf must hold BIG_STR_LEN bytes; returns the length, not NUL terminated
+size_t big_to_dec(const bignum *b, char *buf) {
+    const uint64_t base = 10000000000000000000ULL;  // 10^19
+    uint64_t parts[BIG_LIMBS * 2];
+    bignum t = *b;
+    int np = 0;
+
+    if (t.n == 0) {
+        buf[0] = '0';
+        return 1;
+    }
+
+    while (t.n) {
+        uint64_t rem = 0;
+        for (int i = t.n - 1; i >= 0; i--) {
+            u128 cur = ((u128)rem << 64) | t.limb[i];
+            t.limb[i] = (uint64_t)(cur / base);
+            rem = (uint64_t)(cur % base);
+        }
+        trim(&t);
+        parts[np++] = rem;
+    }
+
+    size_t len = 0;
+    char tmp[20];
+    for (int i = np - 1; i >= 0; i--) {
+        uint64_t v = parts[i];
+        int k = 0;
+        do {
+            tmp[k++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        // inner parts are zero padded to 19 digits
+        if (i != np - 1)
+            while (k < 19)
+                tmp[k++] = '0';
+        while (k)
+            buf[len++] = tmp[--k];
+    }
+    return len;
+}
+
+int big_shl(bignum *b, int bits) {
+    uint64_t carry = 0;
+
+    for (int i = 0; i < b->n; i++) {
+        uint64_t v = b->limb[i];
+        b->limb[i] = (v << bits) | carry;
+        carry = v >> (64 - bits);
+    }
+    if (carry) {
+        if (b->n == BIG_LIMBS)
+            return -1;
+        b->limb[b->n++] = carry;
+    }
+    return 0;
+}
+
+int big_square(bignum *b) {
+    uint64_t r[BIG_LIMBS * 2];
+    int n = b->n;
+
+    if (n <= 1) {
+        uint64_t v = n ? b->limb[0] : 0;
+        u128 t = (u128)v * v;
+        big_set_u64(b, (uint64_t)t);
+        if (t >> 64) {
+            b->limb[1] = t >> 64;
+            b->n = 2;
+        }
+        return 0;
+    }
+
+    if (2 * n - 1 > BIG_LIMBS)
+        return -1;
+
+    memset(r, 0, 2 * n * sizeof(r[0]));
+    for (int i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < n; j++) {
+            u128 t = (u128)b->limb[i] * b->limb[j] + r[i + j] + carry;
+            r[i + j] = (uint64_t)t;
+            carry = t >> 64;
+        }
+        r[i + n] = carry;
+    }
+
+    int rn = 2 * n;
+    while (rn && r[rn - 1] == 0)
+        rn--;
+    if (rn > BIG_LIMBS)
+        return -1;
+    memcpy(b->limb, r, rn * sizeof(r[0]));
+    b->n = rn;
+    return 0;
+}
+
+// floor(sqrt(v)): start from the double estimate and correct the last unit
+static uint64_t isqrt64(uint64_t v) {
+    uint64_t r = (uint64_t)sqrt((double)v);
+
+    if (r > 0xFFFFFFFFULL)
+        r = 0xFFFFFFFFULL;
+    while (r * r > v)
+        r--;
+    while (r < 0xFFFFFFFFULL && (r + 1) * (r + 1) <= v)
+        r++;
+    return r;
+}
+
+static void shl(bignum *b, int bits, uint64_t low) {
+    uint64_t carry = low;
+
+    for (int i = 0; i < b->n; i++) {
+        uint64_t v = b->limb[i];
+        b->limb[i] = (v << bits) | carry;
+        carry = v >> (64 - bits);
+    }
+    if (carry)
+        b->limb[b->n++] = carry;
+}
+
+static int cmp(const bignum *a, const bignum *b) {
+    if (a->n != b->n)
+        return a->n < b->n ? -1 : 1;
+    for (int i = a->n - 1; i >= 0; i--)
+        if (a->limb[i] != b->limb[i])
+            return a->limb[i] < b->limb[i] ? -1 : 1;
+    return 0;
+}
+
+static void sub(bignum *a, const bignum *b) {
+    uint64_t borrow = 0;
+
+    for (int i = 0; i < a->n; i++) {
+        uint64_t bv = i < b->n ? b->limb[i] : 0;
+        uint64_t d = a->limb[i] - bv - borrow;
+        borrow = a->limb[i] < bv || (a->limb[i] == bv && borrow);
+        a->limb[i] = d;
+    }
+    trim(a);
+}
+
+// Single limb values take the isqrt64 fast path; wider ones use the
+// binary digit-by-digit method, two input bits per result bit.
+void big_sqroot(bignum *b) {
+    if (b->n <= 1) {
+        big_set_u64(b, b->n ? isqrt64(b->limb[0]) : 0);
+        return;
+    }
+
+    bignum res, rem, trial;
+    big_set_u64(&res, 0);
+    big_set_u64(&rem, 0);
+
+    for (int bit = b->n * 64 - 2; bit >= 0; bit -= 2) {
+        uint64_t pair = (b->limb[bit / 64] >> (bit % 64)) & 3;
+
+        shl(&rem, 2, pair);
+        trim(&rem);
+        trial = res;
+        shl(&trial, 2, 1);
+        trim(&trial);
+        if (cmp(&rem, &trial) >= 0) {
+            sub(&rem, &trial);
+            shl(&res, 1, 1);
+        } else {
+            shl(&res, 1, 0);
+        }
+        trim(&res);
+    }
+    *b = res;
+}
@@ -0,0 +1,28 @@
+#ifndef __BIGNUM_H_
+#define __BIGNUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64 limbs of 64 bits: enough for a 4096-bit value, i.e. six squarings
+// of a 64-bit input. Anything larger is reported as overflow.
+#define BIG_LIMBS               64
+#define BIG_STR_LEN             (BIG_LIMBS * 20 + 2)
+
+// Unsigned fixed-limb integer, least significant limb first.
+// n is the number of limbs in use (0 for zero).
+typedef struct {
+    int n;
+    uint64_t limb[BIG_LIMBS];
+} bignum;
+
+extern void big_set_u64(bignum *b, uint64_t v);
+extern int big_from_dec(bignum *b, const char *s, const char *end);
+extern size_t big_to_dec(const bignum *b, char *buf);
+
+// return 0 on success, -1 if the result does not fit in BIG_LIMBS
+extern int big_shl(bignum *b, int bits);     // 0 < bits < 64
+extern int big_square(bignum *b);
+extern void big_sqroot(bignum *b);
+
+#endif
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include "stage.h"
+
+#define MAX_STAGES      256
+#define BATCH_SIZE      4096
+#define IO_BUF_SIZE     (64*1024)
+
+enum {
+    WIDTH_INT,      // wraps like the exec'd programs
+    WIDTH_64,       // int64_t with overflow detection
+    WIDTH_BIG,      // bignum with overflow detection
+};
+
+enum {
+    RES_OK,
+    RES_NEGATIVE,
+    RES_OVERFLOW,
+};
+
+static enum stage_op ops[MAX_STAGES];
+static int nops;
+static struct plan_step steps[MAX_STAGES];
+static int nsteps;
+
+static int width = WIDTH_INT;
+static int numInt;
+static int64_t num64;
+static bignum numBig;
+static int bigNeg;
+
+static char outbuf[IO_BUF_SIZE];
+static size_t outlen;
+
+// Hand the rest of the chain to an external program, the same way
+// double/square/sqroot do: the number is passed as the last argument.
+static int execStage(char *argv[], int argc, char *resultStr) {
+    char **nargv = malloc((argc + 1) * sizeof(char *));
+    if (nargv == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(nargv, argv, (argc - 1) * sizeof(char *));
+    nargv[argc - 1] = resultStr;
+    nargv[argc] = NULL;
+
+    execv(nargv[0], nargv);
+    perror("execv");
+    exit(EXIT_FAILURE);
+}
+
+// Load a number in the current width; atoi rules, stopping at a non-digit
+static int loadValue(const char *s, const char *end) {
+    int neg = 0;
+
+    if (width == WIDTH_INT) {
+        unsigned int u = 0;
+        if (s < end && (*s == '-' || *s == '+'))
+            neg = *s++ == '-';
+        while (s < end && *s >= '0' && *s <= '9')
+            u = u * 10 + (*s++ - '0');
+        numInt = neg ? -u : u;
+        return RES_OK;
+    }
+
+    if (s < end && (*s == '-' || *s == '+'))
+        neg = *s++ == '-';
+    if (width == WIDTH_64) {
+        num64 = 0;
+        while (s < end && *s >= '0' && *s <= '9') {
+            if (__builtin_mul_overflow(num64, 10, &num64) ||
+                __builtin_add_overflow(num64, *s++ - '0', &num64))
+                return RES_OVERFLOW;
+        }
+        num64 = neg ? -num64 : num64;
+    } else {
+        if (big_from_dec(&numBig, s, end))
+            return RES_OVERFLOW;
+        bigNeg = neg && numBig.n;
+    }
+    return RES_OK;
+}
+
+static int isNegative(void) {
+    switch (width) {
+        case WIDTH_INT:
+            return numInt < 0;
+        case WIDTH_64:
+            return num64 < 0;
+        default:
+            return bigNeg;
+    }
+}
+
+static int applyValue(const struct plan_step *st) {
+    switch (width) {
+        case WIDTH_INT:
+            return stage_step(st, &numInt) ? RES_NEGATIVE : RES_OK;
+        case WIDTH_64:
+            return stage_step64(st, &num64) ? RES_OVERFLOW : RES_OK;
+        default:
+            return stage_step_big(st, &numBig) ? RES_OVERFLOW : RES_OK;
+    }
+}
+
+// Run the loaded value through the whole plan. The input is checked even
+// when every stage folded away, as the first stage would have done.
+static int runValue(int res) {
+    if (res == RES_OK && nops && isNegative())
+        return RES_NEGATIVE;
+    for (int j = 0; res == RES_OK && j < nsteps; j++) {
+        if (isNegative())
+            return RES_NEGATIVE;
+        res = applyValue(&steps[j]);
+    }
+    return res;
+}
+
+// buf holds at least BIG_STR_LEN bytes; returns the length
+static size_t formatValue(char *buf) {
+    switch (width) {
+        case WIDTH_INT:
+            return sprintf(buf, "%d", numInt);
+        case WIDTH_64:
+            return sprintf(buf, "%lld", (long long)num64);
+        default:
+            return big_to_dec(&numBig, buf);
+    }
+}
+
+static void flushOut(void) {
+    size_t off = 0;
+    while (off < outlen) {
+        ssize_t n = write(STDOUT_FILENO, outbuf + off, outlen - off);
+        if (n == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        off += n;
+    }
+    outlen = 0;
+}
+
+static void emit(const char *s, size_t len) {
+    if (outlen + len > sizeof(outbuf))
+        flushOut();
+    memcpy(outbuf + outlen, s, len);
+    outlen += len;
+}
+
+static void emitInt(int num) {
+    char tmp[16];
+    char *p = tmp + sizeof(tmp);
+    unsigned int u = num < 0 ? -(unsigned int)num : (unsigned int)num;
+
+    *--p = '\n';
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (num < 0)
+        *--p = '-';
+    emit(p, tmp + sizeof(tmp) - p);
+}
+
+// Run one batch through the chain; a negative input to any stage fails
+// that value only, as the exec'd programs would for a single number.
+static void evalBatch(int *vals, int n) {
+    static const char fail[] = "Unable to execute\n";
+    static unsigned char failed[BATCH_SIZE];
+
+    stage_run_batch(steps, nsteps, vals, failed, n);
+    for (int i = 0; i < n; i++) {
+        if (failed[i])
+            emit(fail, sizeof(fail) - 1);
+        else
+            emitInt(vals[i]);
+    }
+}
+
+static int isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Parse whitespace separated numbers (atoi rules) from [p, end) and evaluate
+// them in batches. With partial set, a token touching 'end' may be cut short,
+// so it is left unparsed; returns where parsing stopped.
+static const char *streamBuf(const char *p, const char *end, int partial) {
+    static int vals[BATCH_SIZE];
+    int n = 0;
+
+    for (;;) {
+        while (p < end && isSpace(*p))
+            p++;
+
+        const char *tok = p;
+        while (p < end && !isSpace(*p))
+            p++;
+        if (tok == p || (partial && p == end)) {
+            p = tok;
+            break;
+        }
+
+        if (width != WIDTH_INT) {
+            static const char fail[] = "Unable to execute\n";
+            static const char ovf[] = "Overflow\n";
+            static char str[BIG_STR_LEN + 1];
+
+            switch (runValue(loadValue(tok, p))) {
+                case RES_OK:
+                {
+                    size_t len = formatValue(str);
+                    str[len++] = '\n';
+                    emit(str, len);
+                }
+                break;
+                case RES_NEGATIVE:
+                    emit(fail, sizeof(fail) - 1);
+                    break;
+                default:
+                    emit(ovf, sizeof(ovf) - 1);
+                    break;
+            }
+            continue;
+        }
+
+        const char *q = tok;
+        int neg = 0;
+        unsigned int u = 0;
+        if (*q == '-' || *q == '+')
+            neg = *q++ == '-';
+        while (q < p && *q >= '0' && *q <= '9')
+            u = u * 10 + (*q++ - '0');
+
+        vals[n++] = neg ? -u : u;
+        if (n == BATCH_SIZE) {
+            evalBatch(vals, n);
+            n = 0;
+        }
+    }
+
+    evalBatch(vals, n);
+    return p;
+}
+
+static void streamFd(int fd) {
+    static char inbuf[IO_BUF_SIZE];
+    size_t len = 0;
+    ssize_t n;
+
+    while ((n = read(fd, inbuf + len, sizeof(inbuf) - len)) > 0) {
+        len += n;
+        const char *rest = streamBuf(inbuf, inbuf + len, 1);
+        len -= rest - inbuf;
+        if (len == sizeof(inbuf)) {
+            fprintf(stderr, "Token too long\n");
+            exit(EXIT_FAILURE);
+        }
+        memmove(inbuf, rest, len);
+    }
+    if (n == -1) {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    streamBuf(inbuf, inbuf + len, 0);
+}
+
+static void streamFile(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        // pipes and other special files can still be read
+        streamFd(fd);
+        close(fd);
+        return;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    streamBuf(data, data + st.st_size, 0);
+    munmap(data, st.st_size);
+    close(fd);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l|-b] [-p] <stage>... <number>\n"
+                    "       %s [-l|-b] [-p] -s <stage>...          (numbers from stdin)\n"
+                    "       %s [-l|-b] [-p] -f <file> <stage>...   (numbers from file)\n"
+                    "  -l  64-bit arithmetic, -b big integers; both report Overflow\n"
+                    "  -p  print the compiled plan to stderr\n",
+            prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+static int addStage(const struct stage *st) {
+    if (nops == MAX_STAGES) {
+        fprintf(stderr, "Too many stages\n");
+        exit(EXIT_FAILURE);
+    }
+    ops[nops++] = st->op;
+    return nops;
+}
+
+static void compilePlan(int print) {
+    nsteps = stage_plan(ops, nops, width != WIDTH_INT, steps);
+    if (print)
+        stage_plan_print(stderr, steps, nsteps);
+}
+
+/*
+ * Usage: chain ./double ./square ./sqroot 5
+ *
+ * Builtin stages are evaluated in-process; the first unknown stage is
+ * exec'd with the remaining chain. When invoked through a link named
+ * after a stage (e.g. ./double -> chain), argv[0] is the first stage.
+ *
+ * With -s or -f the chain reads one number per whitespace separated token
+ * and writes one result per line; all stages must then be builtin.
+ *
+ * By default values are ints that wrap like the original programs; -l and
+ * -b switch to checked 64-bit and big-integer arithmetic.
+ *
+ * The builtin stages are compiled once into a plan (see stage_plan) that
+ * is reused for every value; -p prints it.
+ */
+int main(int argc, char *argv[]) {
+    const struct stage *self = stage_lookup(argv[0]);
+    int stream = 0;
+    int print = 0;
+    const char *file = NULL;
+    int i = 1;
+
+    while (i < argc && argv[i][0] == '-' && argv[i][1] != '\0' &&
+           (argv[i][1] < '0' || argv[i][1] > '9')) {
+        if (strcmp(argv[i], "-s") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            stream = 1;
+            file = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0) {
+            width = WIDTH_64;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            width = WIDTH_BIG;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            print = 1;
+        } else {
+            usage(argv[0]);
+        }
+        i++;
+    }
+
+    if (self)
+        addStage(self);
+
+    if (stream) {
+        for (; i < argc; i++) {
+            const struct stage *st = stage_lookup(argv[i]);
+            if (st == NULL) {
+                fprintf(stderr, "%s: not a builtin stage\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            addStage(st);
+        }
+
+        compilePlan(print);
+        if (file)
+            streamFile(file);
+        else
+            streamFd(STDIN_FILENO);
+        flushOut();
+        return 0;
+    }
+
+    if (argc - i < 1 || (argc - i < 2 && !self))
+        usage(argv[0]);
+
+    // builtin prefix of the chain; 'i' ends at the first external stage
+    for (; i < argc - 1 && stage_lookup(argv[i]); i++)
+        addStage(stage_lookup(argv[i]));
+    compilePlan(print);
+
+    const char *arg = argv[argc - 1];
+    static char resultStr[BIG_STR_LEN + 1];
+
+    switch (runValue(loadValue(arg, arg + strlen(arg)))) {
+        case RES_NEGATIVE:
+            printf("Unable to execute");
+            return 0;
+        case RES_OVERFLOW:
+            printf("Overflow\n");
+            return EXIT_FAILURE;
+    }
+
+    resultStr[formatValue(resultStr)] = '\0';
+    if (i < argc - 1) {
+        // the external stage gets the number as its input, like the
+        // builtin ones, so a negative value stops the chain here
+        if (isNegative()) {
+            printf("Unable to execute");
+            return 0;
+        }
+        return execStage(argv + i, argc - i, resultStr);
+    }
+
+    printf("%s\n", resultStr);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stage.h"
+#include "chainproto.h"
+
+// requests in flight before waiting for a response; small enough that
+// the responses fit in the socket buffer while we are still writing
+#define WINDOW          4
+#define BATCH           1024
+#define SLOTS           (WINDOW + 1)    // the batch being filled has one too
+
+static struct chain_req req;
+static uint8_t ops[CHAIN_MAX_OPS];
+static int sock;
+static int pending;
+static int stream;      // -s: one line per number, as chain -s prints them
+static int overflowed;
+// inputs outside int64_t with -l, sent as 0 and reported here as
+// Overflow; one slot per request in flight, by sequence number
+static uint8_t overflow[SLOTS][BATCH];
+static unsigned sent, received;
+
+static void readAll(void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(sock, p, len);
+        if (n <= 0) {
+            fprintf(stderr, "chaind closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void writeAll(const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(sock, p, len);
+        if (n <= 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void recvResponse(void) {
+    static int64_t vals[CHAIN_MAX_VALUES];
+    static uint8_t status[CHAIN_MAX_VALUES];
+    struct chain_resp resp;
+
+    readAll(&resp, sizeof(resp));
+    if (resp.magic != CHAIN_MAGIC || resp.status != CHAIN_OK) {
+        fprintf(stderr, "chaind rejected the request\n");
+        exit(EXIT_FAILURE);
+    }
+    readAll(vals, resp.count * sizeof(int64_t));
+    readAll(status, resp.count);
+
+    uint8_t *ovf = overflow[received++ % SLOTS];
+    for (int i = 0; i < resp.count; i++) {
+        if (ovf[i]) {
+            ovf[i] = 0;
+            printf("Overflow\n");
+            overflowed = 1;
+            continue;
+        }
+        switch (status[i]) {
+            case CHAIN_OK:
+                if (req.width == CHAIN_INT)
+                    printf("%d\n", (int)vals[i]);
+                else
+                    printf("%lld\n", (long long)vals[i]);
+                break;
+            case CHAIN_NEGATIVE:
+                // a single value gets no newline, like chain and sqroot
+                printf(stream ? "Unable to execute\n" : "Unable to execute");
+                break;
+            default:
+                printf("Overflow\n");
+                overflowed = 1;
+                break;
+        }
+    }
+    pending--;
+}
+
+static void sendRequest(const int64_t *vals, int count) {
+    if (pending == WINDOW)
+        recvResponse();
+
+    req.count = count;
+    writeAll(&req, sizeof(req));
+    writeAll(ops, req.nops);
+    writeAll(vals, count * sizeof(int64_t));
+    sent++;
+    pending++;
+}
+
+// Same parsing rules as chain: atoi for ints, overflow checked for -l.
+// A value that does not fit is flagged in the slot of the next request
+// and sent as 0.
+static int64_t parse(const char *s, int idx) {
+    if (req.width == CHAIN_INT)
+        return atoi(s);
+
+    errno = 0;
+    long long v = strtoll(s, NULL, 10);
+    if (errno == ERANGE) {
+        overflow[sent % SLOTS][idx] = 1;
+        return 0;
+    }
+    return v;
+}
+
+// Next whitespace-delimited token of stdin, whole however long it is;
+// NULL at the end of the input
+static char *nextToken(void) {
+    static char *tok;
+    static size_t cap;
+    size_t len = 0;
+    int ch;
+
+    while ((ch = getchar()) != EOF && isspace(ch))
+        ;
+    if (ch == EOF)
+        return NULL;
+    do {
+        if (len + 1 >= cap) {
+            cap = cap ? 2 * cap : 64;
+            if ((tok = realloc(tok, cap)) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        tok[len++] = ch;
+    } while ((ch = getchar()) != EOF && !isspace(ch));
+    tok[len] = '\0';
+    return tok;
+}
+
+static int connectTo(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Usage: chainc [-l] <socket> <stage>... <number>
+ *        chainc [-l] -s <socket> <stage>...
+ *
+ * Thin client for chaind: stages are resolved here and the whole chain is
+ * evaluated by the server. With -s, numbers are read from stdin and sent
+ * in pipelined batches.
+ */
+int main(int argc, char *argv[]) {
+    int i = 1;
+
+    req.magic = CHAIN_MAGIC;
+    req.width = CHAIN_INT;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-l") == 0)
+            req.width = CHAIN_64;
+        else if (strcmp(argv[i], "-s") == 0)
+            stream = 1;
+        else
+            break;
+    }
+    if (argc - i < (stream ? 1 : 2)) {
+        fprintf(stderr, "Usage: %s [-l] <socket> <stage>... <number>\n"
+                        "       %s [-l] -s <socket> <stage>...\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    sock = connectTo(argv[i++]);
+    int last = stream ? argc : argc - 1;
+    for (; i < last; i++) {
+        const struct stage *st = stage_lookup(argv[i]);
+        if (st == NULL) {
+            fprintf(stderr, "%s: not a builtin stage\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (req.nops == CHAIN_MAX_OPS) {
+            fprintf(stderr, "Too many stages\n");
+            exit(EXIT_FAILURE);
+        }
+        ops[req.nops++] = st->op;
+    }
+
+    if (!stream) {
+        int64_t v = parse(argv[argc - 1], 0);
+        sendRequest(&v, 1);
+        recvResponse();
+        return overflowed ? EXIT_FAILURE : 0;
+    }
+
+    static int64_t vals[BATCH];
+    char *tok;
+    int n = 0;
+    while ((tok = nextToken()) != NULL) {
+        vals[n] = parse(tok, n);
+        n++;
+        if (n == BATCH) {
+            sendRequest(vals, n);
+            n = 0;
+        }
+    }
+    if (n)
+        sendRequest(vals, n);
+    while (pending)
+        recvResponse();
+    return 0;
+}
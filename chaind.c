@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "stage.h"
+#include "chainproto.h"
+
+#define MAX_CONNS       64
+
+struct conn {
+    int fd;
+    size_t len;
+    uint8_t in[CHAIN_MAX_REQ];
+    // responses not taken by the socket yet: out[outOff, outLen)
+    size_t outOff;
+    size_t outLen;
+    uint8_t out[2 * CHAIN_MAX_RESP];
+    // plan of the last request, reused while the chain stays the same
+    int width;
+    int nops;
+    uint8_t ops[CHAIN_MAX_OPS];
+    int nsteps;
+    struct plan_step steps[CHAIN_MAX_OPS];
+};
+
+static struct conn *conns[MAX_CONNS];
+static struct pollfd pfds[MAX_CONNS + 1];
+
+static int ivals[CHAIN_MAX_VALUES];
+static unsigned char ifail[CHAIN_MAX_VALUES];
+
+// Write as much pending output as the socket takes without blocking;
+// returns -1 if the connection is gone
+static int flushOut(struct conn *c) {
+    while (c->outOff < c->outLen) {
+        ssize_t n = write(c->fd, c->out + c->outOff, c->outLen - c->outOff);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->outOff += n;
+    }
+    c->outOff = c->outLen = 0;
+    return 0;
+}
+
+// Room for one more response at the end of c->out
+static int outRoom(struct conn *c) {
+    if (sizeof(c->out) - c->outLen < CHAIN_MAX_RESP && c->outOff) {
+        memmove(c->out, c->out + c->outOff, c->outLen - c->outOff);
+        c->outLen -= c->outOff;
+        c->outOff = 0;
+    }
+    return sizeof(c->out) - c->outLen >= CHAIN_MAX_RESP;
+}
+
+static void evalInt(struct conn *c, const int64_t *vals, int64_t *res, uint8_t *status, int count) {
+    for (int i = 0; i < count; i++)
+        ivals[i] = vals[i];
+    stage_run_batch(c->steps, c->nsteps, ivals, ifail, count);
+    for (int i = 0; i < count; i++) {
+        res[i] = ivals[i];
+        status[i] = ifail[i] ? CHAIN_NEGATIVE : CHAIN_OK;
+    }
+}
+
+static void eval64(struct conn *c, const int64_t *vals, int64_t *res, uint8_t *status, int count) {
+    for (int i = 0; i < count; i++) {
+        int64_t num = vals[i];
+        uint8_t st = c->nops && num < 0 ? CHAIN_NEGATIVE : CHAIN_OK;
+
+        for (int j = 0; st == CHAIN_OK && j < c->nsteps; j++) {
+            if (stage_step64(&c->steps[j], &num))
+                st = CHAIN_OVERFLOW;
+        }
+        res[i] = num;
+        status[i] = st;
+    }
+}
+
+// Queue the answer to the request at 'frame' on c->out, which must have
+// room for it; returns its size, 0 if it is not complete yet, or -1 to
+// drop c
+static long handleFrame(struct conn *c, const uint8_t *frame, size_t avail) {
+    struct chain_req req;
+    uint8_t *out = c->out + c->outLen;
+    struct chain_resp *resp = (struct chain_resp *)out;
+
+    memcpy(&req, frame, sizeof(req));
+    if (req.magic != CHAIN_MAGIC || req.count > CHAIN_MAX_VALUES)
+        return -1;
+    size_t size = sizeof(req) + req.nops + req.count * sizeof(int64_t);
+    if (avail < size)
+        return 0;
+
+    const uint8_t *ops = frame + sizeof(req);
+    resp->magic = CHAIN_MAGIC;
+    resp->count = req.count;
+    resp->status = CHAIN_OK;
+
+    for (int j = 0; j < req.nops; j++)
+        if (ops[j] >= MAX_STAGE_OPS)
+            resp->status = CHAIN_EINVAL;
+    if (req.width != CHAIN_INT && req.width != CHAIN_64)
+        resp->status = CHAIN_EINVAL;
+    if (resp->status != CHAIN_OK) {
+        resp->count = 0;
+        c->outLen += sizeof(*resp);
+        return -1;
+    }
+
+    if (req.width != c->width || req.nops != c->nops || memcmp(ops, c->ops, req.nops)) {
+        enum stage_op sops[CHAIN_MAX_OPS];
+        for (int j = 0; j < req.nops; j++)
+            sops[j] = ops[j];
+        c->width = req.width;
+        c->nops = req.nops;
+        memcpy(c->ops, ops, req.nops);
+        c->nsteps = stage_plan(sops, req.nops, req.width != CHAIN_INT, c->steps);
+    }
+
+    int64_t vals[CHAIN_MAX_VALUES], res[CHAIN_MAX_VALUES];
+    uint8_t *status = out + sizeof(*resp) + req.count * sizeof(int64_t);
+    memcpy(vals, ops + req.nops, req.count * sizeof(int64_t));
+
+    if (req.width == CHAIN_INT)
+        evalInt(c, vals, res, status, req.count);
+    else
+        eval64(c, vals, res, status, req.count);
+    memcpy(out + sizeof(*resp), res, req.count * sizeof(int64_t));
+
+    c->outLen += sizeof(*resp) + req.count * (sizeof(int64_t) + 1);
+    return size;
+}
+
+// Answer the complete requests in c->in while c->out has room. Returns 1
+// if some were left for lack of room, or -1 to drop c.
+static int answerFrames(struct conn *c) {
+    size_t off = 0;
+    int full = 0;
+
+    while (c->len - off >= sizeof(struct chain_req)) {
+        if (!outRoom(c)) {
+            full = 1;
+            break;
+        }
+        long used = handleFrame(c, c->in + off, c->len - off);
+        if (used < 0)
+            return -1;
+        if (used == 0)
+            break;
+        off += used;
+    }
+
+    memmove(c->in, c->in + off, c->len - off);
+    c->len -= off;
+    return full;
+}
+
+// Read what is available and answer every complete request in it, so
+// pipelined requests are served in one pass and their responses go out
+// in as few writes as possible. A client that does not read its
+// responses is not read from either until they drain. Returns -1 to
+// drop c.
+static int serveConn(struct conn *c, short revents) {
+    if (revents & POLLERR)
+        return -1;
+    if ((revents & POLLIN) && c->len < sizeof(c->in)) {
+        ssize_t n = read(c->fd, c->in + c->len, sizeof(c->in) - c->len);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return -1;
+        if (n > 0)
+            c->len += n;
+    }
+
+    for (;;) {
+        int full = answerFrames(c);
+        if (full < 0) {
+            flushOut(c);        // best effort: the CHAIN_EINVAL response
+            return -1;
+        }
+        if (flushOut(c))
+            return -1;
+        if (!full || c->outLen)
+            return 0;
+    }
+}
+
+static int listenOn(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 64) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Usage: chaind <socket>
+ *
+ * Serves chain requests (see chainproto.h) for any number of clients from
+ * one process, so a request costs a socket round trip instead of a
+ * fork/execv per stage.
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <socket>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pfds[0].fd = listenOn(argv[1]);
+    pfds[0].events = POLLIN;
+    for (int i = 1; i <= MAX_CONNS; i++)
+        pfds[i].fd = -1;
+
+    for (;;) {
+        if (poll(pfds, MAX_CONNS + 1, -1) == -1) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(pfds[0].fd, NULL, NULL);
+            int i;
+            for (i = 0; fd != -1 && i < MAX_CONNS; i++)
+                if (conns[i] == NULL)
+                    break;
+            if (fd != -1 && i < MAX_CONNS && fcntl(fd, F_SETFL, O_NONBLOCK) != -1 &&
+                (conns[i] = calloc(1, sizeof(struct conn)))) {
+                conns[i]->fd = fd;
+                conns[i]->width = -1;
+                pfds[i + 1].fd = fd;
+                pfds[i + 1].events = POLLIN;
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        for (int i = 0; i < MAX_CONNS; i++) {
+            if (conns[i] == NULL || !pfds[i + 1].revents)
+                continue;
+            if (serveConn(conns[i], pfds[i + 1].revents)) {
+                close(conns[i]->fd);
+                free(conns[i]);
+                conns[i] = NULL;
+                pfds[i + 1].fd = -1;
+            } else {
+                // stop reading while the responses are backed up
+                pfds[i + 1].events = conns[i]->outLen ? POLLOUT : POLLIN;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef __CHAINPROTO_H_
+#define __CHAINPROTO_H_
+
+#include <stdint.h>
+
+/*
+ * Framing between chainc and chaind over a local Unix socket, host byte
+ * order. A client may send any number of requests before reading; each
+ * gets exactly one response, in order.
+ *
+ * request:  chain_req, ops[nops] (enum stage_op), int64_t vals[count]
+ * response: chain_resp, int64_t vals[count], uint8_t status[count]
+ */
+#define CHAIN_MAGIC             0x314e4843      // "CHN1"
+#define CHAIN_MAX_OPS           255
+#define CHAIN_MAX_VALUES        4096
+#define CHAIN_MAX_REQ           (sizeof(struct chain_req) + CHAIN_MAX_OPS + \
+                                 CHAIN_MAX_VALUES * sizeof(int64_t))
+#define CHAIN_MAX_RESP          (sizeof(struct chain_resp) + \
+                                 CHAIN_MAX_VALUES * (sizeof(int64_t) + 1))
+
+enum {
+    CHAIN_INT,          // wraps like the exec'd programs
+    CHAIN_64,           // checked int64_t
+};
+
+enum {
+    CHAIN_OK,
+    CHAIN_NEGATIVE,     // "Unable to execute"
+    CHAIN_OVERFLOW,
+    CHAIN_EINVAL,       // malformed request; the connection is closed
+};
+
+struct chain_req {
+    uint32_t magic;
+    uint8_t width;
+    uint8_t nops;
+    uint16_t count;
+};
+
+struct chain_resp {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t status;    // CHAIN_OK or CHAIN_EINVAL for the whole frame
+};
+
+#endif
@@ -0,0 +1,319 @@
+#include <string.h>
+#include <math.h>
+#include "stage.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STAGE_X86
+#endif
+
+// wrap through unsigned so overflow behaves like the exec'd programs
+// without being undefined
+int stage_double(int num) {
+    return 2u * num;
+}
+
+int stage_square(int num) {
+    return (unsigned int)num * num;
+}
+
+// sqrt of a double is correctly rounded, so truncating it is the exact
+// integer square root for every non-negative int
+int stage_sqroot(int num) {
+    return sqrt((int)num);
+}
+
+static const struct stage stages[] = {
+    { "double", STAGE_DOUBLE, stage_double },
+    { "square", STAGE_SQUARE, stage_square },
+    { "sqroot", STAGE_SQROOT, stage_sqroot },
+};
+
+// chains name their stages by path (./double), so compare basenames
+const struct stage *stage_lookup(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        if (strcmp(name, stages[i].name) == 0)
+            return &stages[i];
+    }
+    return NULL;
+}
+
+int stage_plan(const enum stage_op *ops, int nops, int checked,
+               struct plan_step *steps) {
+    int n = 0;
+
+    for (int i = 0; i < nops; i++) {
+        struct plan_step *top = n ? &steps[n - 1] : NULL;
+
+        switch (ops[i]) {
+            case STAGE_DOUBLE:
+                if (top && top->kind == PLAN_SHIFT && top->shift < PLAN_MAX_SHIFT) {
+                    top->shift++;
+                    continue;
+                }
+                steps[n].kind = PLAN_SHIFT;
+                steps[n++].shift = 1;
+                break;
+            case STAGE_SQUARE:
+                steps[n].kind = PLAN_SQUARE;
+                steps[n++].shift = 0;
+                break;
+            case STAGE_SQROOT:
+                // inputs are never negative, so sqrt(x*x) is x itself
+                // unless x*x wraps; checked modes report that overflow
+                if (top && top->kind == PLAN_SQUARE && !checked) {
+                    top->kind = PLAN_ABS;
+                    continue;
+                }
+                steps[n].kind = PLAN_SQROOT;
+                steps[n++].shift = 0;
+                break;
+            default:
+                break;
+        }
+    }
+    return n;
+}
+
+void stage_plan_print(FILE *fp, const struct plan_step *steps, int nsteps) {
+    static const char *names[] = { "shl", "square", "sqroot", "abs" };
+
+    fprintf(fp, "plan:");
+    if (nsteps == 0)
+        fprintf(fp, " identity");
+    for (int i = 0; i < nsteps; i++) {
+        fprintf(fp, " %s", names[steps[i].kind]);
+        if (steps[i].kind == PLAN_SHIFT)
+            fprintf(fp, " %d", steps[i].shift);
+    }
+    fprintf(fp, "\n");
+}
+
+// the bits that become the sign bit before the last of 'shift' doubles
+static unsigned int shiftFailMask(int shift) {
+    return ((1u << (shift - 1)) - 1) << (32 - shift);
+}
+
+int stage_step(const struct plan_step *st, int *num) {
+    switch (st->kind) {
+        case PLAN_SHIFT:
+            if (*num & shiftFailMask(st->shift))
+                return -1;
+            *num = (unsigned int)*num << st->shift;
+            return 0;
+        case PLAN_SQUARE:
+            *num = stage_square(*num);
+            return 0;
+        case PLAN_SQROOT:
+            *num = stage_sqroot(*num);
+            return 0;
+        case PLAN_ABS:
+            // 46340^2 is the largest square that fits in an int
+            if (*num > 46340) {
+                int sq = stage_square(*num);
+                if (sq < 0)
+                    return -1;
+                *num = stage_sqroot(sq);
+            }
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+int stage_step64(const struct plan_step *st, int64_t *num) {
+    switch (st->kind) {
+        case PLAN_SHIFT:
+            if (*num > (INT64_MAX >> st->shift))
+                return -1;
+            *num <<= st->shift;
+            return 0;
+        case PLAN_SQUARE:
+            return __builtin_mul_overflow(*num, *num, num) ? -1 : 0;
+        case PLAN_SQROOT:
+        {
+            // doubles lose precision above 2^53, so fix up the estimate
+            uint64_t v = *num;
+            uint64_t r = sqrt((double)*num);
+            while (r * r > v)
+                r--;
+            while ((r + 1) * (r + 1) <= v)
+                r++;
+            *num = r;
+        }
+        return 0;
+        case PLAN_ABS:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+int stage_step_big(const struct plan_step *st, bignum *num) {
+    switch (st->kind) {
+        case PLAN_SHIFT:
+            return big_shl(num, st->shift);
+        case PLAN_SQUARE:
+            return big_square(num);
+        case PLAN_SQROOT:
+            big_sqroot(num);
+            return 0;
+        case PLAN_ABS:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static void runScalar(const struct plan_step *steps, int nsteps,
+                      int *vals, unsigned char *fail, int n) {
+    for (int i = 0; i < n; i++) {
+        int num = vals[i];
+        unsigned char bad = 0;
+
+        for (int j = 0; j < nsteps; j++) {
+            bad |= num < 0;
+            bad |= stage_step(&steps[j], &num) != 0;
+        }
+        vals[i] = num;
+        fail[i] = bad;
+    }
+}
+
+#ifdef STAGE_X86
+__attribute__((target("avx2")))
+static inline __m256i sqrtAvx2(__m256i x) {
+    __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(x));
+    __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1));
+    x = _mm256_castsi128_si256(_mm256_cvttpd_epi32(_mm256_sqrt_pd(lo)));
+    return _mm256_inserti128_si256(x, _mm256_cvttpd_epi32(_mm256_sqrt_pd(hi)), 1);
+}
+
+__attribute__((target("avx2")))
+static void runAvx2(const struct plan_step *steps, int nsteps,
+                    int *vals, unsigned char *fail, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(vals + i));
+        __m256i bad = zero;
+
+        for (int j = 0; j < nsteps; j++) {
+            bad = _mm256_or_si256(bad, _mm256_cmpgt_epi32(zero, x));
+            switch (steps[j].kind) {
+                case PLAN_SHIFT:
+                {
+                    __m256i mask = _mm256_set1_epi32(shiftFailMask(steps[j].shift));
+                    __m256i ok = _mm256_cmpeq_epi32(_mm256_and_si256(x, mask), zero);
+                    bad = _mm256_or_si256(bad, _mm256_xor_si256(ok, ones));
+                    x = _mm256_sll_epi32(x, _mm_cvtsi32_si128(steps[j].shift));
+                }
+                break;
+                case PLAN_SQUARE:
+                    x = _mm256_mullo_epi32(x, x);
+                    break;
+                case PLAN_SQROOT:
+                    x = sqrtAvx2(x);
+                    break;
+                case PLAN_ABS:
+                    // all lanes are computed anyway, so keep the exact form
+                    x = _mm256_mullo_epi32(x, x);
+                    bad = _mm256_or_si256(bad, _mm256_cmpgt_epi32(zero, x));
+                    x = sqrtAvx2(x);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        _mm256_storeu_si256((__m256i *)(vals + i), x);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+        for (int k = 0; k < 8; k++)
+            fail[i + k] = (m >> k) & 1;
+    }
+
+    runScalar(steps, nsteps, vals + i, fail + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i sqrtSse41(__m128i x) {
+    __m128d lo = _mm_cvtepi32_pd(x);
+    __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xEE));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_sqrt_pd(lo)),
+                              _mm_cvttpd_epi32(_mm_sqrt_pd(hi)));
+}
+
+__attribute__((target("sse4.1")))
+static void runSse41(const struct plan_step *steps, int nsteps,
+                     int *vals, unsigned char *fail, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(-1);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((__m128i *)(vals + i));
+        __m128i bad = zero;
+
+        for (int j = 0; j < nsteps; j++) {
+            bad = _mm_or_si128(bad, _mm_cmpgt_epi32(zero, x));
+            switch (steps[j].kind) {
+                case PLAN_SHIFT:
+                {
+                    __m128i mask = _mm_set1_epi32(shiftFailMask(steps[j].shift));
+                    __m128i ok = _mm_cmpeq_epi32(_mm_and_si128(x, mask), zero);
+                    bad = _mm_or_si128(bad, _mm_xor_si128(ok, ones));
+                    x = _mm_sll_epi32(x, _mm_cvtsi32_si128(steps[j].shift));
+                }
+                break;
+                case PLAN_SQUARE:
+                    x = _mm_mullo_epi32(x, x);
+                    break;
+                case PLAN_SQROOT:
+                    x = sqrtSse41(x);
+                    break;
+                case PLAN_ABS:
+                    x = _mm_mullo_epi32(x, x);
+                    bad = _mm_or_si128(bad, _mm_cmpgt_epi32(zero, x));
+                    x = sqrtSse41(x);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        _mm_storeu_si128((__m128i *)(vals + i), x);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(bad));
+        for (int k = 0; k < 4; k++)
+            fail[i + k] = (m >> k) & 1;
+    }
+
+    runScalar(steps, nsteps, vals + i, fail + i, n - i);
+}
+#endif
+
+typedef void (*batch_fn)(const struct plan_step *, int, int *, unsigned char *, int);
+
+static batch_fn pickBatch(void) {
+#ifdef STAGE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return runAvx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return runSse41;
+#endif
+    return runScalar;
+}
+
+void stage_run_batch(const struct plan_step *steps, int nsteps,
+                     int *vals, unsigned char *fail, int n) {
+    static batch_fn run;
+
+    if (run == NULL)
+        run = pickBatch();
+    run(steps, nsteps, vals, fail, n);
+}
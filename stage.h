@@ -0,0 +1,68 @@
+#ifndef __STAGE_H_
+#define __STAGE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bignum.h"
+
+// In-process versions of the double, square and sqroot programs
+typedef int (*stage_fn)(int num);
+
+enum stage_op {
+    STAGE_DOUBLE,
+    STAGE_SQUARE,
+    STAGE_SQROOT,
+    MAX_STAGE_OPS
+};
+
+struct stage {
+    const char *name;
+    enum stage_op op;
+    stage_fn fn;
+};
+
+extern int stage_double(int num);
+extern int stage_square(int num);
+extern int stage_sqroot(int num);
+
+// match a chain element (name or path) to a builtin stage; NULL if unknown
+extern const struct stage *stage_lookup(const char *path);
+
+///////////////////////////////////////////////////////////////////////
+/////////////////////////// Chain plans //////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+#define PLAN_MAX_SHIFT 31
+
+enum plan_kind {
+    PLAN_SHIFT,     // 'shift' consecutive doubles
+    PLAN_SQUARE,
+    PLAN_SQROOT,
+    PLAN_ABS,       // square then sqroot on ints, i.e. x unless x*x wraps
+};
+
+struct plan_step {
+    enum plan_kind kind;
+    int shift;
+};
+
+// Compile a chain into at most nops steps. With checked set (64-bit and
+// big modes) square-then-sqroot is kept as is, as the square may overflow
+// and that must be reported.
+extern int stage_plan(const enum stage_op *ops, int nops, int checked,
+                      struct plan_step *steps);
+extern void stage_plan_print(FILE *fp, const struct plan_step *steps, int nsteps);
+
+// Apply one step to a non-negative input. The int version wraps like the
+// exec'd programs and returns -1 when a folded stage would have seen a
+// negative input; the 64-bit and big versions return -1 on overflow.
+extern int stage_step(const struct plan_step *st, int *num);
+extern int stage_step64(const struct plan_step *st, int64_t *num);
+extern int stage_step_big(const struct plan_step *st, bignum *num);
+
+// Run vals[0..n) through the whole plan in place, one pass over the data.
+// fail[i] is set when value i reached some stage as a negative number.
+extern void stage_run_batch(const struct plan_step *steps, int nsteps,
+                            int *vals, unsigned char *fail, int n);
+
+#endif
@@ -3,6 +3,7 @@
 #include<lib.h>
 #include<entry.h>
 #include<file.h>
+#include<mmap.h>
 #include<tracer.h>
 
 
@@ -18,6 +19,29 @@ enum {
 };
 
 
+// Buffer pages are reference counted as the consumer may map them: the
+// buffer holds the reference taken at allocation and every user pte one
+// more, so that a munmap() of the mapping never frees a page in use
+static void tb_page_put(void *page)
+{
+	u32 pfn = (u64)page >> TRACE_BUFFER_PAGE_SHIFT;
+
+	put_pfn(pfn);
+	if (!get_pfn_refcount(pfn))
+		os_page_free(USER_REG, page);
+}
+
+static void free_ring (struct trace_buffer_info *tb, struct trace_ring *ring)
+{
+	if (ring->pages) {
+		for (u32 i = 0; i < tb->npages; i++)
+			if (ring->pages[i])
+				tb_page_put(ring->pages[i]);
+		os_free(ring->pages, tb->npages * sizeof(u8 *));
+		ring->pages = NULL;
+	}
+}
+
 static inline void free_alloc_depth (struct file *fptr, u32 depth)
 {
 	if (fptr) {
@@ -28,9 +52,11 @@ static inline void free_alloc_depth (struct file *fptr, u32 depth)
 					fptr->fops = NULL;
 				}
 			case DEPTH3:
-				if (fptr->trace_buffer->buff) {
-					os_page_free(USER_REG, fptr->trace_buffer->buff);
-					fptr->trace_buffer->buff = NULL;
+				for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++)
+					free_ring(fptr->trace_buffer, &fptr->trace_buffer->ring[i]);
+				if (fptr->trace_buffer->hdr) {
+					tb_page_put(fptr->trace_buffer->hdr);
+					fptr->trace_buffer->hdr = NULL;
 				}
 			case DEPTH2:
 				if (fptr->trace_buffer) {
@@ -38,10 +64,7 @@ static inline void free_alloc_depth (struct file *fptr, u32 depth)
 					fptr->trace_buffer = NULL;
 				}
 			case DEPTH1:
-				if (fptr) {
-					os_free(fptr, sizeof(struct file));
-					fptr->fops = NULL;
-				}
+				os_free(fptr, sizeof(struct file));
 		}
 	}
 }
@@ -117,6 +140,144 @@ int is_valid_mem_range(unsigned long buff, u32 count, int access_bit)
 	return 0;
 }
 
+#define TB_PTE_P 0x1
+#define TB_PTE_W 0x2
+#define TB_PTE_U 0x4
+#define TB_PFN(entry) (((entry) >> TRACE_BUFFER_PAGE_SHIFT) & 0xFFFFFFFFFFUL)
+
+// Walk the 4-level page table of ctx to the pte of addr, allocating the
+// missing levels if 'alloc' is set
+static u64 *tb_get_pte(struct exec_context *ctx, u64 addr, int alloc)
+{
+	u64 *table = osmap(ctx->pgd);
+
+	for (int shift = 39; shift > TRACE_BUFFER_PAGE_SHIFT; shift -= 9) {
+		u64 *entry = &table[(addr >> shift) & 0x1FF];
+
+		if (!(*entry & TB_PTE_P)) {
+			u64 pfn;
+			if (!alloc || !(pfn = os_pfn_alloc(OS_PT_REG)))
+				return NULL;
+			memset((char *)osmap(pfn), 0, TRACE_BUFFER_PAGE_SIZE);
+			*entry = (pfn << TRACE_BUFFER_PAGE_SHIFT) | TB_PTE_P | TB_PTE_W | TB_PTE_U;
+		}
+		table = osmap(TB_PFN(*entry));
+	}
+	return &table[(addr >> TRACE_BUFFER_PAGE_SHIFT) & 0x1FF];
+}
+
+// the pte takes a reference to 'page', see tb_page_put()
+static int tb_map_page(struct exec_context *ctx, u64 addr, void *page, u64 flags)
+{
+	u64 *pte = tb_get_pte(ctx, addr, 1);
+	u32 pfn = (u64)page >> TRACE_BUFFER_PAGE_SHIFT;
+
+	if (!pte)
+		return -ENOMEM;
+	if (*pte & TB_PTE_P) {
+		put_pfn(TB_PFN(*pte));
+		if (!get_pfn_refcount(TB_PFN(*pte)))
+			os_pfn_free(USER_REG, TB_PFN(*pte));
+	}
+	get_pfn(pfn);
+	*pte = ((u64)pfn << TRACE_BUFFER_PAGE_SHIFT) | flags;
+	asm volatile("invlpg (%0)" :: "r" (addr) : "memory");
+	return 0;
+}
+
+static inline u64 tb_map_len(struct trace_buffer_info *tb)
+{
+	return TRACE_BUFFER_PAGE_SIZE + TRACE_BUFFER_PRODUCERS * 2 * (u64)tb->size;
+}
+
+// Map ring 'idx' twice back to back at its slot of the user mapping
+static int tb_map_ring(struct trace_buffer_info *tb, int idx)
+{
+	struct trace_ring *ring = &tb->ring[idx];
+	u64 addr = tb->map_addr + TRACE_BUFFER_PAGE_SIZE + idx * 2 * (u64)tb->size;
+
+	for (u32 i = 0; i < tb->npages; i++) {
+		u64 off = (u64)i << TRACE_BUFFER_PAGE_SHIFT;
+		if (tb_map_page(tb->map_ctx, addr + off, ring->pages[i], TB_PTE_P | TB_PTE_U) ||
+		    tb_map_page(tb->map_ctx, addr + tb->size + off, ring->pages[i], TB_PTE_P | TB_PTE_U))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+// Whether the consumer still has the header page where it was mapped;
+// it may have munmap()ed the area, the pages survive that anyway
+static int tb_mapped(struct trace_buffer_info *tb)
+{
+	u64 *pte;
+
+	if (!tb->map_addr)
+		return 0;
+	pte = tb_get_pte(tb->map_ctx, tb->map_addr, 0);
+	return pte && (*pte & TB_PTE_P) && TB_PFN(*pte) == (u64)tb->hdr >> TRACE_BUFFER_PAGE_SHIFT;
+}
+
+// unmapping drops the references of the ptes, see tb_page_put()
+static void trace_buffer_unmap(struct trace_buffer_info *tb)
+{
+	if (tb_mapped(tb))
+		vm_area_unmap(tb->map_ctx, tb->map_addr, tb_map_len(tb));
+	tb->map_addr = 0;
+	tb->map_ctx = NULL;
+}
+
+/* Map a trace buffer into the caller: the writable header page followed
+   by a slot per producer ring, whose pages are read-only and mapped twice
+   back to back so that a record wrapping past the end can be parsed in
+   place. Rings allocated later are mapped into their slot as they come.
+   Only buffers created with TRACE_BUFFER_MAPPABLE can be mapped.
+   return the user address or -errno
+ */
+long sys_map_trace_buffer(struct exec_context *current, int fd)
+{
+	struct file *filep;
+	struct trace_buffer_info *tb;
+	long addr;
+
+	if (fd < 0 || fd >= MAX_OPEN_FILES)
+		return -EINVAL;
+	filep = current->files[fd];
+	if (!filep || filep->type != TRACE_BUFFER || !(filep->mode & O_READ))
+		return -EINVAL;
+
+	tb = filep->trace_buffer;
+	if (!(tb->flags & TRACE_BUFFER_MAPPABLE))
+		return -EINVAL;
+	if (tb_mapped(tb))
+		return tb->map_ctx == current ? (long)tb->map_addr : -EINVAL;
+	// munmap()ed by the consumer, map it afresh
+	tb->map_addr = 0;
+	tb->map_ctx = NULL;
+
+	addr = vm_area_map(current, 0, tb_map_len(tb), PROT_READ, 0);
+	if (addr <= 0)
+		return -ENOMEM;
+	// the vm_area of the header must allow the consumer's writes too
+	if (vm_area_mprotect(current, addr, TRACE_BUFFER_PAGE_SIZE, PROT_READ | PROT_WRITE) < 0)
+		goto fail;
+	tb->map_addr = addr;
+	tb->map_ctx  = current;
+
+	if (tb_map_page(current, addr, tb->hdr, TB_PTE_P | TB_PTE_W | TB_PTE_U))
+		goto fail;
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++)
+		if (tb->ring[i].pages && tb_map_ring(tb, i))
+			goto fail;
+
+	return tb->map_addr;
+
+fail:
+	vm_area_unmap(current, addr, tb_map_len(tb));
+	tb->map_addr = 0;
+	tb->map_ctx = NULL;
+	return -ENOMEM;
+}
+
 // Last call
 long trace_buffer_close(struct file *filep)
 {
@@ -124,44 +285,130 @@ long trace_buffer_close(struct file *filep)
 	if (!filep)
 		return -EINVAL;
 
+	trace_buffer_unmap(filep->trace_buffer);
 	free_alloc_depth(filep, DEPTHM);
 
 	return 0;
 }
 
-
-int _trace_buffer_read(struct file *filep, char *buff, u32 count)
+static int alloc_ring(struct trace_buffer_info *tb, int idx, u32 pid)
 {
-	int i;
-	u8 *tbuff = filep->trace_buffer->buff;
-	u32 is_full = filep->trace_buffer->is_full;
-	u32 curr_r_offset = filep->trace_buffer->r_offset;
-	u32 curr_w_offset = filep->trace_buffer->w_offset;
+	struct trace_ring *ring = &tb->ring[idx];
 
-	// if tbuf has nothing to read
-	if (!is_full && curr_r_offset == curr_w_offset) {
-		return 0;
+	if (NULL == (ring->pages = os_alloc(tb->npages * sizeof(u8 *))))
+		return -ENOMEM;
+	for (u32 i = 0; i < tb->npages; i++)
+		ring->pages[i] = NULL;
+	for (u32 i = 0; i < tb->npages; i++) {
+		if (NULL == (ring->pages[i] = (u8 *)os_page_alloc(USER_REG))) {
+			free_ring(tb, ring);
+			return -ENOMEM;
+		}
 	}
 
-	// read byte-by-byte
-	for (i = 0; i<count; i++) {
-		buff[i] = tbuff[curr_r_offset];
-		curr_r_offset = (curr_r_offset + 1) % TRACE_BUFFER_MAX_SIZE;
+	ring->pid = pid;
+	ring->hdr = &tb->hdr->ring[idx];
+	ring->hdr->r_offset = 0;
+	ring->hdr->w_offset = 0;
+	ring->hdr->dropped = 0;
+	ring->hdr->skipped = 0;
+	ring->hdr->pid = pid;
+	ring->enc_base = 0;
+	ring->dec_base = 0;
+
+	if (tb_mapped(tb) && tb_map_ring(tb, idx)) {
+		// keep the mapping consistent: an unmapped ring is never used
+		free_ring(tb, ring);
+		ring->hdr->pid = 0;
+		return -ENOMEM;
+	}
+	return 0;
+}
 
-		// check if this byte read has made tbuff empty
-		if (curr_r_offset == curr_w_offset)
-			break;
+// A consumer that maps the buffer owns r_offset, so never trust it to be
+// within one buffer size of w_offset
+static inline u32 tb_used(struct trace_buffer_info *tb, struct trace_ring *ring)
+{
+	u32 r = __atomic_load_n(&ring->hdr->r_offset, __ATOMIC_ACQUIRE);
+	u32 w = __atomic_load_n(&ring->hdr->w_offset, __ATOMIC_ACQUIRE);
+
+	if (w - r > tb->size) {
+		__atomic_store_n(&ring->hdr->r_offset, w - tb->size, __ATOMIC_RELEASE);
+		return tb->size;
+	}
+	return w - r;
+}
+
+// Ring of the calling context, allocated on its first record. When every
+// ring is taken, one whose records have all been read is handed over;
+// NULL if there is none. Ring 0 stays with the creator.
+static struct trace_ring *producer_ring(struct trace_buffer_info *tb)
+{
+	u32 pid = get_current_ctx()->pid;
+	int free = -1, drained = -1;
+
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++) {
+		if (tb->ring[i].pages && tb->ring[i].pid == pid)
+			return &tb->ring[i];
+		if (!tb->ring[i].pages && free < 0)
+			free = i;
+		if (i && tb->ring[i].pages && drained < 0 && !tb_used(tb, &tb->ring[i]))
+			drained = i;
 	}
+	if (free >= 0)
+		return alloc_ring(tb, free, pid) ? NULL : &tb->ring[free];
+	if (drained < 0)
+		return NULL;
+
+	// the dropped and skipped counts stay, they are totals of the buffer
+	tb->ring[drained].pid = pid;
+	tb->ring[drained].hdr->pid = pid;
+	tb->ring[drained].enc_base = 0;
+	tb->ring[drained].dec_base = 0;
+	return &tb->ring[drained];
+}
 
-	// update r_offset with current val
-	filep->trace_buffer->r_offset = curr_r_offset;
+// Copy 'count' bytes between buff and the ring starting at ring offset
+// 'pos', one memcpy per page touched
+static void ring_copy(struct trace_buffer_info *tb, struct trace_ring *ring, u32 pos, char *buff, u32 count, int to_ring)
+{
+	while (count) {
+		u32 off   = pos & tb->mask;
+		u32 poff  = off & (TRACE_BUFFER_PAGE_SIZE - 1);
+		u32 chunk = TRACE_BUFFER_PAGE_SIZE - poff;
+		char *page = (char *)ring->pages[off >> TRACE_BUFFER_PAGE_SHIFT] + poff;
+
+		if (chunk > count)
+			chunk = count;
+		if (to_ring)
+			memcpy(page, buff, chunk);
+		else
+			memcpy(buff, page, chunk);
+
+		pos   += chunk;
+		buff  += chunk;
+		count -= chunk;
+	}
+}
 
-	// if is_full set then unset it
-	if (is_full && count)
-		filep->trace_buffer->is_full = 0;
+// raw data lives in ring 0
+int _trace_buffer_read(struct file *filep, char *buff, u32 count)
+{
+	struct trace_buffer_info *tb = filep->trace_buffer;
+	struct trace_ring *ring = &tb->ring[0];
+	u32 used = tb_used(tb, ring);
+	u32 r = ring->hdr->r_offset;
+
+	// read no more than what tbuff holds
+	if (count > used)
+		count = used;
+	if (!count)
+		return 0;
 
-	return i==count?i:i+1;
+	ring_copy(tb, ring, r, buff, count, 0);
+	__atomic_store_n(&ring->hdr->r_offset, r + count, __ATOMIC_RELEASE);
 
+	return count;
 }
 
 /* Copy from trace buff to user buff
@@ -177,34 +424,163 @@ int trace_buffer_read(struct file *filep, char *buff, u32 count)
 
 int _trace_buffer_write(struct file *filep, char *buff, u32 count)
 {
-	int i;
-	u8 *tbuff = filep->trace_buffer->buff;
-	u32 is_full = filep->trace_buffer->is_full;
-	u32 curr_r_offset = filep->trace_buffer->r_offset;
-	u32 curr_w_offset = filep->trace_buffer->w_offset;
+	struct trace_buffer_info *tb = filep->trace_buffer;
+	struct trace_ring *ring = &tb->ring[0];
+	u32 avail = tb->size - tb_used(tb, ring);
+	u32 w = ring->hdr->w_offset;
+
+	// write no more than the free space in tbuff
+	if (count > avail)
+		count = avail;
+	if (!count)
+		return 0;
+
+	ring_copy(tb, ring, w, buff, count, 1);
+	__atomic_store_n(&ring->hdr->w_offset, w + count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+/* Whether an event passes 'l': 1 in sample_n events, then a token bucket
+ * refilled at 'rate' tokens per 2^TRACE_RATE_SHIFT cycles
+ */
+int trace_limit_pass(struct trace_limit *l)
+{
+	if (l->sample_n > 1) {
+		if (++l->sample_cnt < l->sample_n)
+			return 0;
+		l->sample_cnt = 0;
+	}
+	if (l->rate) {
+		u64 now = trace_clock();
+		u64 elapsed = now - l->last_ts;
+
+		if (elapsed >> TRACE_RATE_SHIFT) {
+			l->tokens = l->rate;
+			l->last_ts = now;
+		} else {
+			u64 refill = (elapsed * l->rate) >> TRACE_RATE_SHIFT;
+
+			if (refill) {
+				l->tokens = l->tokens + refill > l->rate ? l->rate : l->tokens + refill;
+				l->last_ts = now;
+			}
+		}
+		if (!l->tokens)
+			return 0;
+		l->tokens--;
+	}
+	return 1;
+}
+
+// account an event the caller chose not to record, on its ring if it
+// has one already or else on ring 0: a skip never allocates a ring
+void trace_buffer_skip(struct file *fptr)
+{
+	struct trace_buffer_info *tb = fptr->trace_buffer;
+	u32 pid = get_current_ctx()->pid;
 
-	// if tbuf is full
-	if (is_full && curr_r_offset == curr_w_offset) {
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++) {
+		if (tb->ring[i].pages && tb->ring[i].pid == pid) {
+			tb->ring[i].hdr->skipped++;
+			return;
+		}
+	}
+	tb->ring[0].hdr->skipped++;
+}
+
+/* Commit one whole record from a tracer into the caller's ring, stamped
+   with trace_clock(); returns len, or 0 if dropped. In overwrite mode
+   the oldest records are discarded to make room.
+ */
+int trace_buffer_push(struct file *fptr, char *rec, u32 len)
+{
+	struct trace_buffer_info *tb = fptr->trace_buffer;
+	struct trace_ring *ring = producer_ring(tb);
+	u64 ts = trace_clock();
+	u32 total = sizeof(ts) + len;
+	u32 avail, w;
+
+	if (!ring) {
+		tb->ring[0].hdr->dropped++;
 		return 0;
 	}
 
-	for (i = 0; i<count; i++) {
-		tbuff[curr_w_offset] = buff[i];
-		curr_w_offset = (curr_w_offset + 1) % TRACE_BUFFER_MAX_SIZE;
+	avail = tb->size - tb_used(tb, ring);
+	if (total > avail) {
+		if (!(tb->flags & TRACE_BUFFER_OVERWRITE) || !tb->rec_len || total > tb->size) {
+			ring->hdr->dropped++;
+			return 0;
+		}
+		// the consumer may advance r_offset meanwhile, hence the cmpxchg
+		while (total > avail) {
+			u32 r = __atomic_load_n(&ring->hdr->r_offset, __ATOMIC_ACQUIRE);
+			u32 used = tb->size - avail;
+			u32 victim = sizeof(ts) + tb->rec_len(tb, ring, r + sizeof(ts));
+
+			// a mapping consumer left r_offset off a record boundary
+			if (victim > used)
+				victim = used;
+			if (__atomic_compare_exchange_n(&ring->hdr->r_offset, &r, r + victim, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				ring->hdr->dropped++;
+			avail = tb->size - tb_used(tb, ring);
+		}
+	}
+
+	// fill the record in, then publish it with a single store
+	w = ring->hdr->w_offset;
+	ring_copy(tb, ring, w, (char *)&ts, sizeof(ts), 1);
+	ring_copy(tb, ring, w + sizeof(ts), rec, len, 1);
+	__atomic_store_n(&ring->hdr->w_offset, w + total, __ATOMIC_RELEASE);
 
-		// check if this write has made buffer full
-		if (curr_r_offset == curr_w_offset) {
-			// update the is_full flag
-			filep->trace_buffer->is_full = 1;
+	return len;
+}
 
-			break;
+/* Take the oldest record across all producer rings into rec, without its
+   timestamp; returns its length, 0 if there is none, or -ENOSPC if it
+   does not fit in max bytes (it is then left in place).
+ */
+int trace_buffer_peek(struct file *fptr, char *rec, u32 max, struct trace_ring **from)
+{
+	struct trace_buffer_info *tb = fptr->trace_buffer;
+	struct trace_ring *oldest = NULL;
+	u64 oldest_ts = 0;
+	u32 len;
+
+	if (!tb->rec_len)
+		return 0;
+
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++) {
+		struct trace_ring *ring = &tb->ring[i];
+		u64 ts;
+
+		if (!ring->pages || tb_used(tb, ring) < sizeof(ts))
+			continue;
+		ring_copy(tb, ring, ring->hdr->r_offset, (char *)&ts, sizeof(ts), 0);
+		if (!oldest || ts < oldest_ts) {
+			oldest = ring;
+			oldest_ts = ts;
 		}
 	}
+	if (!oldest)
+		return 0;
+
+	len = tb->rec_len(tb, oldest, oldest->hdr->r_offset + sizeof(oldest_ts));
+	if (len > max)
+		return -ENOSPC;
 
-	// update r_offset with current val
-	filep->trace_buffer->w_offset = curr_w_offset;
+	ring_copy(tb, oldest, oldest->hdr->r_offset + sizeof(oldest_ts), rec, len, 0);
+	*from = oldest;
+
+	return len;
+}
+
+void trace_buffer_consume(struct trace_ring *ring, u32 len)
+{
+	u32 r = ring->hdr->r_offset;
 
-	return i==count?i:i+1;
+	__atomic_store_n(&ring->hdr->r_offset, r + sizeof(u64) + len, __ATOMIC_RELEASE);
 }
 
 /* Copy from user buff to trace buff
@@ -218,11 +594,38 @@ int trace_buffer_write(struct file *filep, char *buff, u32 count)
 	return _trace_buffer_write(filep, buff, count);
 }
 
+long trace_buffer_lseek(struct file *filep, long offset, int whence)
+{
+	struct trace_buffer_info *tb = filep->trace_buffer;
+	long total = 0;
+
+	if (whence != TRACE_BUFFER_SEEK_DROPPED && whence != TRACE_BUFFER_SEEK_SKIPPED)
+		return -EINVAL;
+
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++)
+		if (tb->ring[i].pages)
+			total += whence == TRACE_BUFFER_SEEK_DROPPED ? tb->ring[i].hdr->dropped
+								     : tb->ring[i].hdr->skipped;
+	return total;
+}
+
+static u64 trace_buffer_ids;
+
 int sys_create_trace_buffer(struct exec_context *current, int mode)
 {
 	int fd;
 	struct file *fptr = NULL;
 	struct exec_context *ctx = current;
+	struct trace_buffer_info *tb;
+	u32 req_pages = (u32)mode >> TRACE_BUFFER_PAGES_SHIFT;
+	u32 flags = mode & (TRACE_BUFFER_OVERWRITE | TRACE_BUFFER_MAPPABLE);
+	u32 npages = 1;
+
+	if (req_pages > TRACE_BUFFER_MAX_PAGES)
+		return -EINVAL;
+	while (npages < req_pages)
+		npages <<= 1;
+	mode &= (1 << TRACE_BUFFER_PAGES_SHIFT) - 1 - TRACE_BUFFER_OVERWRITE - TRACE_BUFFER_MAPPABLE;
 
 	// find a free file descriptor in files array; use lowest/first
 	// fds {0, 1, 2} are already allocated hence starting at '3'
@@ -241,19 +644,44 @@ int sys_create_trace_buffer(struct exec_context *current, int mode)
 	fptr->mode = mode;
 	fptr->offp = 0;
 	fptr->ref_count = 1;
-	if (NULL == (fptr->trace_buffer = os_alloc(sizeof(struct trace_buffer_info))))
+	if (NULL == (fptr->trace_buffer = os_alloc(sizeof(struct trace_buffer_info)))) {
 		free_alloc_depth(fptr, DEPTH1);
-	if (NULL == (fptr->trace_buffer->buff = (u8 *)os_page_alloc(USER_REG)))
+		return -ENOMEM;
+	}
+	tb = fptr->trace_buffer;
+	tb->npages = npages;
+	tb->size = npages * TRACE_BUFFER_PAGE_SIZE;
+	tb->mask = tb->size - 1;
+	tb->flags = flags;
+	tb->rec_len = NULL;
+	tb->map_addr = 0;
+	tb->map_ctx = NULL;
+	tb->id = ++trace_buffer_ids;
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++) {
+		tb->ring[i].pages = NULL;
+		tb->ring[i].pid = 0;
+	}
+	if (NULL == (tb->hdr = os_page_alloc(USER_REG))) {
 		free_alloc_depth(fptr, DEPTH2);
-	fptr->trace_buffer->r_offset = 0;
-	fptr->trace_buffer->w_offset = 0;
-	fptr->trace_buffer->is_full = 0;
-	if (NULL == (fptr->fops = os_alloc(sizeof(struct fileops))))
+		return -ENOMEM;
+	}
+	memset((char *)tb->hdr, 0, TRACE_BUFFER_PAGE_SIZE);
+	tb->hdr->size = tb->size;
+	tb->hdr->flags = flags;
+	for (int i = 0; i < TRACE_BUFFER_PRODUCERS; i++)
+		tb->ring[i].hdr = &tb->hdr->ring[i];
+	if (alloc_ring(tb, 0, ctx->pid)) {
+		free_alloc_depth(fptr, DEPTH3);
+		return -ENOMEM;
+	}
+	if (NULL == (fptr->fops = os_alloc(sizeof(struct fileops)))) {
 		free_alloc_depth(fptr, DEPTH3);
+		return -ENOMEM;
+	}
 	fptr->fops->read = trace_buffer_read;
 	fptr->fops->write = trace_buffer_write;
 	fptr->fops->close = trace_buffer_close;
-	fptr->fops->lseek = NULL;
+	fptr->fops->lseek = trace_buffer_lseek;
 
 	ctx->files[fd] = fptr;
 
@@ -264,89 +692,228 @@ int sys_create_trace_buffer(struct exec_context *current, int mode)
 //// 		Start of strace functionality 		      	      /////
 ///////////////////////////////////////////////////////////////////////////
 
-typedef struct {
-	u32 syscall_num;
-	u32 sysarg_cnt;
-} syscall_arg_cnt;
-
-// add syscalls into below map as per need
-syscall_arg_cnt sysarg_map[] = {
-					{ SYSCALL_EXIT       , 0},
-					{ SYSCALL_GETPID     , 0},
-					{ SYSCALL_GETPPID     , 0},
-					{ SYSCALL_FORK     , 0},
-					{ SYSCALL_CFORK     , 0},
-					{ SYSCALL_VFORK     , 0},
-					{ SYSCALL_PHYS_INFO     , 0},
-					{ SYSCALL_STATS     , 0},
-					{ SYSCALL_GET_COW_F     , 0},
-					{ SYSCALL_CONFIGURE     , 1},
-					{ SYSCALL_DUMP_PTT     , 1},
-					{ SYSCALL_SLEEP     , 1},
-					{ SYSCALL_PMAP     , 1},
-					{ SYSCALL_CLOSE     , 1},
-					{ SYSCALL_DUP     , 1},
-					{ SYSCALL_DUP2     , 2},
-					{ SYSCALL_SIGNAL     , 2},
-					{ SYSCALL_EXPAND     , 2},
-					{ SYSCALL_CLONE     , 2},
-					{ SYSCALL_MUNMAP     , 2},
-					{ SYSCALL_MMAP       , 3},
-					{ SYSCALL_OPEN       , 3},
-					{ SYSCALL_MPROTECT       , 3},
-					{ SYSCALL_READ       , 3},
-					{ SYSCALL_WRITE      , 3},
-					{ SYSCALL_LSEEK      , 3},
-					{ SYSCALL_STRACE      , 2},
-					{ SYSCALL_FTRACE      , 4},
-					{ SYSCALL_TRACE_BUFFER      , 1},
-					{ SYSCALL_READ_STRACE      , 3},
-					{ SYSCALL_READ_FTRACE      , 3},
-					{ SYSCALL_END_STRACE      , 0}
-			       };
-
-// return index in the above array if fptr == NULL
-int push_strace_data (struct file *fptr, u64 syscall_num, u64 param1, u64 param2, u64 param3, u64 param4)
-{
-	int i = 0, wbytes = 0;
-	while (sysarg_map[i].syscall_num != syscall_num) {
-		i++;
-	}
-	
-	if (!fptr)
-		return i;
+#define SYSCALL(nr, nm, n, ...) \
+	[nr] = { .name = nm, .nargs = n, .args = { __VA_ARGS__ } }
+#define ARG(t, nm) { .type = SYSARG_##t, .name = nm }
+
+// indexed by syscall number; add syscalls here as per need
+const struct syscall_meta syscall_meta[STRACE_NR_SYSCALLS] = {
+	SYSCALL(SYSCALL_EXIT,		"exit",		0),
+	SYSCALL(SYSCALL_GETPID,		"getpid",	0),
+	SYSCALL(SYSCALL_GETPPID,	"getppid",	0),
+	SYSCALL(SYSCALL_FORK,		"fork",		0),
+	SYSCALL(SYSCALL_CFORK,		"cfork",	0),
+	SYSCALL(SYSCALL_VFORK,		"vfork",	0),
+	SYSCALL(SYSCALL_PHYS_INFO,	"phys_info",	0),
+	SYSCALL(SYSCALL_STATS,		"stats",	0),
+	SYSCALL(SYSCALL_GET_COW_F,	"get_cow_fault_stats", 0),
+	SYSCALL(SYSCALL_CONFIGURE,	"configure",	1, ARG(PTR, "config")),
+	SYSCALL(SYSCALL_DUMP_PTT,	"dump_page_table", 1, ARG(PTR, "addr")),
+	SYSCALL(SYSCALL_SLEEP,		"sleep",	1, ARG(INT, "ticks")),
+	SYSCALL(SYSCALL_PMAP,		"pmap",		1, ARG(INT, "details")),
+	SYSCALL(SYSCALL_CLOSE,		"close",	1, ARG(FD, "fd")),
+	SYSCALL(SYSCALL_DUP,		"dup",		1, ARG(FD, "oldfd")),
+	SYSCALL(SYSCALL_DUP2,		"dup2",		2, ARG(FD, "oldfd"), ARG(FD, "newfd")),
+	SYSCALL(SYSCALL_SIGNAL,		"signal",	2, ARG(INT, "signum"), ARG(PTR, "handler")),
+	SYSCALL(SYSCALL_EXPAND,		"expand",	2, ARG(SIZE, "size"), ARG(FLAGS, "flags")),
+	SYSCALL(SYSCALL_CLONE,		"clone",	2, ARG(PTR, "func"), ARG(PTR, "stack")),
+	SYSCALL(SYSCALL_MUNMAP,		"munmap",	2, ARG(PTR, "addr"), ARG(SIZE, "length")),
+	SYSCALL(SYSCALL_MMAP,		"mmap",		3, ARG(PTR, "addr"), ARG(SIZE, "length"), ARG(FLAGS, "prot")),
+	SYSCALL(SYSCALL_OPEN,		"open",		3, ARG(PTR, "filename"), ARG(FLAGS, "flags"), ARG(FLAGS, "mode")),
+	SYSCALL(SYSCALL_MPROTECT,	"mprotect",	3, ARG(PTR, "addr"), ARG(SIZE, "length"), ARG(FLAGS, "prot")),
+	SYSCALL(SYSCALL_READ,		"read",		3, ARG(FD, "fd"), ARG(PTR, "buf"), ARG(SIZE, "count")),
+	SYSCALL(SYSCALL_WRITE,		"write",	3, ARG(FD, "fd"), ARG(PTR, "buf"), ARG(SIZE, "count")),
+	SYSCALL(SYSCALL_LSEEK,		"lseek",	3, ARG(FD, "fd"), ARG(INT, "offset"), ARG(INT, "whence")),
+	SYSCALL(SYSCALL_STRACE,		"strace",	2, ARG(INT, "syscall_num"), ARG(INT, "action")),
+	SYSCALL(SYSCALL_FTRACE,		"ftrace",	4, ARG(PTR, "faddr"), ARG(INT, "action"), ARG(INT, "nargs"), ARG(FD, "fd")),
+	SYSCALL(SYSCALL_TRACE_BUFFER,	"create_trace_buffer", 1, ARG(FLAGS, "mode")),
+	SYSCALL(SYSCALL_READ_STRACE,	"read_strace",	3, ARG(FD, "fd"), ARG(PTR, "buff"), ARG(INT, "count")),
+	SYSCALL(SYSCALL_READ_FTRACE,	"read_ftrace",	3, ARG(FD, "fd"), ARG(PTR, "buff"), ARG(INT, "count")),
+	SYSCALL(SYSCALL_END_STRACE,	"end_strace",	0),
+};
 
-	switch (sysarg_map[i].sysarg_cnt) {
-		case 0:
-			wbytes += _trace_buffer_write(fptr, (char *)&syscall_num, (u32) sizeof(syscall_num));
-			break;
-		case 1:
-			wbytes += _trace_buffer_write(fptr, (char *)&syscall_num, (u32) sizeof(syscall_num));
-			wbytes += _trace_buffer_write(fptr, (char *)&param1, (u32) sizeof(param1));
-			break;
-		case 2:
-			wbytes += _trace_buffer_write(fptr, (char *)&syscall_num, (u32) sizeof(syscall_num));
-			wbytes += _trace_buffer_write(fptr, (char *)&param1, (u32) sizeof(param1));
-			wbytes += _trace_buffer_write(fptr, (char *)&param2, (u32) sizeof(param2));
-			break;
-		case 3:
-			wbytes += _trace_buffer_write(fptr, (char *)&syscall_num, (u32) sizeof(syscall_num));
-			wbytes += _trace_buffer_write(fptr, (char *)&param1, (u32) sizeof(param1));
-			wbytes += _trace_buffer_write(fptr, (char *)&param2, (u32) sizeof(param2));
-			wbytes += _trace_buffer_write(fptr, (char *)&param3, (u32) sizeof(param3));
-			break;
-		case 4:
-			wbytes += _trace_buffer_write(fptr, (char *)&syscall_num, (u32) sizeof(syscall_num));
-			wbytes += _trace_buffer_write(fptr, (char *)&param1, (u32) sizeof(param1));
-			wbytes += _trace_buffer_write(fptr, (char *)&param2, (u32) sizeof(param2));
-			wbytes += _trace_buffer_write(fptr, (char *)&param3, (u32) sizeof(param3));
-			wbytes += _trace_buffer_write(fptr, (char *)&param4, (u32) sizeof(param4));
-			break;
-		default:
-			return -1;
+#undef ARG
+#undef SYSCALL
+
+// size of the strace record at ring offset 'pos'
+static u32 strace_rec_len(struct trace_buffer_info *tb, struct trace_ring *ring, u32 pos)
+{
+	u8 b[2];
+
+	ring_copy(tb, ring, pos, (char *)b, sizeof(b), 0);
+	if (b[0] & STRACE_REC_COMPACT)
+		return b[0] & ~STRACE_REC_COMPACT;
+	return b[0] | (b[1] << 8);	// strace_rec_hdr.len
+}
+
+static inline u32 put_varint(u8 *p, u64 v)
+{
+	u32 n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static inline u32 get_varint(u8 *p, u64 *v)
+{
+	u32 n = 0, shift = 0;
+
+	*v = 0;
+	do {
+		*v |= (u64)(p[n] & 0x7f) << shift;
+		shift += 7;
+	} while (p[n++] & 0x80 && shift < 64);
+	return n;
+}
+
+static inline u64 zigzag(u64 v)
+{
+	return (v << 1) ^ (u64)((long)v >> 63);
+}
+
+static inline u64 unzigzag(u64 v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+// compact form of the record: see STRACE_REC_COMPACT in tracer.h
+static int push_strace_compact(struct file *fptr, const struct syscall_meta *meta, u64 syscall_num, u64 *args)
+{
+	struct trace_buffer_info *tb = fptr->trace_buffer;
+	struct trace_ring *ring = producer_ring(tb);
+	u8 rec[STRACE_COMPACT_MAX];
+	u32 nargs = meta ? meta->nargs : 0;
+	u64 base = ring ? ring->enc_base : 0;
+	u32 len = 2;
+	int ret;
+
+	rec[1] = meta ? 0 : STRACE_REC_UNKNOWN;
+	// deltas need every record to reach sys_read_strace() in order, which
+	// is fixed when the buffer is created
+	if (!(tb->flags & (TRACE_BUFFER_OVERWRITE | TRACE_BUFFER_MAPPABLE)))
+		rec[1] |= STRACE_REC_DELTA;
+
+	len += put_varint(rec + len, syscall_num);
+	for (u32 i = 0; i < nargs; i++) {
+		u64 v = args[i];
+
+		switch (meta->args[i].type) {
+			case SYSARG_PTR:
+				if (rec[1] & STRACE_REC_DELTA)
+					v = zigzag(v - base);
+				base = args[i];
+				break;
+			case SYSARG_INT:
+				v = zigzag(v);
+				break;
+		}
+		len += put_varint(rec + len, v);
+	}
+	rec[0] = STRACE_REC_COMPACT | len;
+
+	tb->rec_len = strace_rec_len;
+	ret = trace_buffer_push(fptr, (char *)rec, len);
+	if (ret > 0 && ring)
+		ring->enc_base = base;
+	return ret;
+}
+
+/* Expand the compact record at 'src' into a strace_rec_hdr record at
+ * 'dst'; 'base' is the delta base of the ring the record came from.
+ * Returns the size of the expanded record.
+ */
+int strace_decode_compact(u8 *src, u64 *base, char *dst)
+{
+	struct strace_rec_hdr *hdr = (struct strace_rec_hdr *)dst;
+	u64 *args = (u64 *)(hdr + 1);
+	const struct syscall_meta *meta;
+	u32 pos = 2, nargs;
+	u64 v;
+
+	pos += get_varint(src + pos, &v);
+	meta = syscall_meta_get(v);
+	nargs = meta ? meta->nargs : 0;
+
+	hdr->len = sizeof(*hdr) + nargs * sizeof(u64);
+	hdr->flags = src[1] & ~STRACE_REC_DELTA;
+	hdr->syscall_num = v;
+	for (u32 i = 0; i < nargs; i++) {
+		pos += get_varint(src + pos, &v);
+		switch (meta->args[i].type) {
+			case SYSARG_PTR:
+				if (src[1] & STRACE_REC_DELTA)
+					v = *base + unzigzag(v);
+				*base = v;
+				break;
+			case SYSARG_INT:
+				v = unzigzag(v);
+				break;
+		}
+		args[i] = v;
 	}
+	return hdr->len;
+}
+
+// unknown syscalls are recorded without arguments
+int push_strace_data (struct file *fptr, int compact, u64 syscall_num, u64 param1, u64 param2, u64 param3, u64 param4)
+{
+	const struct syscall_meta *meta = syscall_meta_get(syscall_num);
+	struct {
+		struct strace_rec_hdr hdr;
+		u64 args[4];
+	} rec;
+	u32 nargs = meta ? meta->nargs : 0;
+
+	rec.args[0] = param1;
+	rec.args[1] = param2;
+	rec.args[2] = param3;
+	rec.args[3] = param4;
+	if (compact)
+		return push_strace_compact(fptr, meta, syscall_num, rec.args);
+
+	// assemble the record so that it is committed (or dropped) whole
+	rec.hdr.len = sizeof(rec.hdr) + nargs * sizeof(u64);
+	rec.hdr.flags = meta ? 0 : STRACE_REC_UNKNOWN;
+	rec.hdr.syscall_num = syscall_num;
+
+	fptr->trace_buffer->rec_len = strace_rec_len;
+	return trace_buffer_push(fptr, (char *)&rec, rec.hdr.len);
+}
+
+static inline int strace_filter_test(struct strace_head *st_head, u64 syscall_num)
+{
+	if (syscall_num >= STRACE_NR_SYSCALLS)
+		return 0;
+	return (st_head->filter[syscall_num >> 6] >> (syscall_num & 63)) & 1;
+}
+
+static void strace_head_init(struct strace_head *st_head)
+{
+	st_head->count = 0;
+	st_head->flags = 0;
+	st_head->in_syscall = 0;
+	st_head->hist = NULL;
+	st_head->counts = NULL;
+	st_head->limits = NULL;
+	st_head->preds = NULL;
+	memset((char *)st_head->filter, 0, sizeof(st_head->filter));
+}
+
+static inline int strace_preds_pass(struct strace_pred_tab *tab, u64 syscall_num, u64 *params)
+{
+	struct strace_cpred *p = &tab->pred[tab->start[syscall_num]];
 
-	return wbytes;
+	for (u32 i = tab->n[syscall_num]; i; i--, p++) {
+		u64 v = params[p->param];
+
+		if ((v & p->mask) != p->mask || v - p->lo > p->span)
+			return 0;
+	}
+	return 1;
 }
 
 // this shall be called even before a syscall's handler
@@ -361,46 +928,117 @@ int perform_tracing(u64 syscall_num, u64 param1, u64 param2, u64 param3, u64 par
 
 	struct strace_head *st_head = ctx->st_md_base;
 
-	if (!st_head)
+	if (!st_head || st_head->is_traced != 1)
 		return 0;	// if a process is not traced then its still ok!
 
-	struct file *fptr = ctx->files[st_head->strace_fd];
-	if (!fptr)
-		return -EINVAL;
+	if (st_head->preds && syscall_num < STRACE_NR_SYSCALLS && st_head->preds->n[syscall_num]) {
+		u64 params[4] = {param1, param2, param3, param4};
 
-	struct trace_buffer_info *st_info = fptr->trace_buffer;
+		if (!strace_preds_pass(st_head->preds, syscall_num, params))
+			return 0;
+	}
 
-	if (st_head->is_traced == 1) {
-		switch (st_head->tracing_mode) {
-			case FULL_TRACING:
-			{
-				// copy syscall info to trace buff
-				push_strace_data (fptr, syscall_num, param1, param2, param3, param4);
-			}
+	switch (st_head->tracing_mode) {
+		case FULL_TRACING:
 			break;
-			case FILTERED_TRACING:
-			{
-				struct strace_info *ptr = st_head->next;
-				int st_cnt 		= st_head->count;
-
-				// check if st is already enabled for the syscall
-				while (st_cnt) {
-					if (syscall_num == ptr->syscall_num)
-						break;
-					ptr = ptr->next;
-					st_cnt--;
-				}
-				if (st_cnt) {
-					// copy syscall info to trace buff
-					push_strace_data (fptr, syscall_num, param1, param2, param3, param4);
-				}
-			}
+		case FILTERED_TRACING:
+			if (!strace_filter_test(st_head, syscall_num))
+				return 0;
 			break;
-			default:
-				return -EINVAL;
+		case COUNT_TRACING:
+			if (syscall_num < STRACE_NR_SYSCALLS)
+				st_head->counts[syscall_num].calls++;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (st_head->tracing_mode != COUNT_TRACING && !(st_head->flags & STRACE_HISTOGRAM)) {
+		struct file *fptr = ctx->files[st_head->strace_fd];
+		if (!fptr)
+			return -EINVAL;
+
+		if (st_head->limits && syscall_num < STRACE_NR_SYSCALLS &&
+		    !trace_limit_pass(&st_head->limits[syscall_num])) {
+			trace_buffer_skip(fptr);
+			return 0;
 		}
+
+		// copy syscall info to trace buff
+		push_strace_data (fptr, st_head->flags & STRACE_COMPACT, syscall_num, param1, param2, param3, param4);
+	}
+
+	// taken last so that the duration excludes our own work
+	if (st_head->tracing_mode == COUNT_TRACING || (st_head->flags & (STRACE_LATENCY | STRACE_HISTOGRAM))) {
+		st_head->in_syscall = 1;
+		st_head->entry_nr = syscall_num;
+		st_head->entry_ts = trace_clock();
+	}
+
+	return 0;
+}
+
+static void strace_hist_add(struct strace_head *st_head, u64 syscall_num, u64 cycles)
+{
+	struct strace_hist *hist;
+	int b = 63 - __builtin_clzll(cycles | 1);
+
+	if (!st_head->hist || syscall_num >= STRACE_NR_SYSCALLS)
+		return;
+	hist = st_head->hist[syscall_num];
+	if (!hist) {
+		if (NULL == (hist = os_alloc(sizeof(struct strace_hist))))
+			return;
+		memset((char *)hist, 0, sizeof(*hist));
+		st_head->hist[syscall_num] = hist;
+	}
+	if (b >= STRACE_HIST_BUCKETS)
+		b = STRACE_HIST_BUCKETS - 1;
+	hist->bucket[b]++;
+}
+
+// this shall be called once a syscall's handler has returned 'ret'
+int perform_tracing_exit(u64 syscall_num, long ret)
+{
+	struct exec_context *ctx = get_current_ctx();
+	struct strace_head *st_head = ctx->st_md_base;
+	u64 now = trace_clock();
+	struct {
+		struct strace_rec_hdr hdr;
+		u64 args[3];
+	} rec;
+
+	// only syscalls whose entry was traced
+	if (!st_head || !st_head->in_syscall || st_head->entry_nr != syscall_num)
+		return 0;
+	st_head->in_syscall = 0;
+
+	if (st_head->tracing_mode == COUNT_TRACING && syscall_num < STRACE_NR_SYSCALLS) {
+		struct strace_count *cnt = &st_head->counts[syscall_num];
+
+		cnt->cycles += now - st_head->entry_ts;
+		if ((syscall_num == SYSCALL_READ || syscall_num == SYSCALL_WRITE) && ret > 0)
+			cnt->bytes += ret;
 	}
+	if (st_head->flags & STRACE_HISTOGRAM)
+		strace_hist_add(st_head, syscall_num, now - st_head->entry_ts);
+	if (st_head->tracing_mode == COUNT_TRACING || (st_head->flags & STRACE_HISTOGRAM))
+		return 0;
+
+	struct file *fptr = ctx->files[st_head->strace_fd];
+	if (!fptr)
+		return -EINVAL;
 
+	// exit records always use the regular layout
+	rec.hdr.len = sizeof(rec);
+	rec.hdr.flags = STRACE_REC_EXIT;
+	rec.hdr.syscall_num = syscall_num;
+	rec.args[0] = ret;
+	rec.args[1] = st_head->entry_ts;
+	rec.args[2] = now - st_head->entry_ts;
+
+	fptr->trace_buffer->rec_len = strace_rec_len;
+	trace_buffer_push(fptr, (char *)&rec, rec.hdr.len);
 	return 0;
 }
 
@@ -422,79 +1060,53 @@ int sys_strace(struct exec_context *current, int syscall_num, int action)
 		// initialize
 		st_head->tracing_mode = FILTERED_TRACING;
 		st_head->is_traced    = 0;
-		st_head->count        = 0;
-		st_head->next         = NULL;
-		st_head->last         = NULL;
+		strace_head_init(st_head);
 	}
 
 
-	struct strace_info *ptr = st_head->next;
-	int              st_cnt = st_head->count;
+	if (syscall_num < 0 || syscall_num >= STRACE_NR_SYSCALLS)
+		return -EINVAL;
+
+	u64 *word = &st_head->filter[syscall_num >> 6];
+	u64  bit  = 1ULL << (syscall_num & 63);
+	u32  arg  = (u32)action >> STRACE_ARG_SHIFT;
+
+	action &= (1 << STRACE_ARG_SHIFT) - 1;
+	if ((action == SAMPLE_STRACE || action == RATE_STRACE) && !st_head->limits) {
+		st_head->limits = os_page_alloc(OS_DS_REG);
+		if (st_head->limits == NULL)
+			return -EINVAL;
+		memset((char *)st_head->limits, 0, STRACE_NR_SYSCALLS * sizeof(struct trace_limit));
+	}
 
 	switch(action) {
 		case ADD_STRACE:
 		{
-			// check if st is already enabled for the syscall
-			while (st_cnt) {
-				if (syscall_num == ptr->syscall_num)
-					return -EINVAL;
-				ptr = ptr->next;
-				st_cnt--;
-			}
-
-			// first check if the current count is within max
-			if (st_head->count + 1 > MAX_STRACE)
-				return -EINVAL;
-
-			// syscall not traced hence add: at head or tail
-			ptr = os_alloc(sizeof(struct strace_info));
-			if (ptr == NULL)
+			// already enabled for the syscall
+			if (*word & bit)
 				return -EINVAL;
-			ptr->syscall_num = syscall_num;
-			ptr->next = NULL;
-
-			if (st_head->count) {
-				// at the tail
-				st_head->last->next = ptr;
-				st_head->last = ptr;
-			} else {
-				// first addition
-				st_head->last = st_head->next = ptr;
-			}
+			*word |= bit;
 			st_head->count += 1;
 		}
 		break;
 		case REMOVE_STRACE:
 		{
-			// check if st is actually enabled for the syscall
-			struct strace_info *t = NULL;
-			while (st_cnt) {
-				if (syscall_num == ptr->syscall_num)
-					break;
-				// 't' will always be a node behind 'ptr'
-				t = ptr;
-				ptr = ptr->next;
-				st_cnt--;
-			}
-			if (st_cnt) {
-				// syscall traced hence disable it
-				// remove its strace_info entry: head, mid, end
-				if (ptr == st_head->next) {
-					// head deletion
-					st_head->next = ptr->next;
-				} else if (ptr == st_head->last) {
-					// tail deletion
-					st_head->last = t;
-				} else {
-					t->next = ptr->next;
-				}
-				os_free(ptr, sizeof(struct strace_info));
-				st_head->count -= 1;
-			} else
-				// trying to remove something i.e. not present
+			// trying to remove something i.e. not present
+			if (!(*word & bit))
 				return -EINVAL;
+			*word &= ~bit;
+			st_head->count -= 1;
 		}
 		break;
+		case SAMPLE_STRACE:
+			st_head->limits[syscall_num].sample_n = arg;
+			st_head->limits[syscall_num].sample_cnt = 0;
+		break;
+		case RATE_STRACE:
+			st_head->limits[syscall_num].rate = arg;
+			st_head->limits[syscall_num].tokens = arg;
+			st_head->limits[syscall_num].last_ts = trace_clock();
+		break;
 		default:
 			return -EINVAL;
 	}
@@ -502,41 +1114,213 @@ int sys_strace(struct exec_context *current, int syscall_num, int action)
 	return 0;
 }
 
-int sys_read_strace(struct file *filep, char *buff, u64 count)
+/* Replace the argument predicates of 'syscall_num' with the 'n' in the
+ * user array 'preds', n == 0 removes them; returns 0 or -errno
+ */
+int sys_strace_filter(struct exec_context *current, int syscall_num, struct strace_pred *preds, int n)
 {
-	u32 rbytes = 0;
+	struct strace_head *st_head = current->st_md_base;
+	struct strace_cpred cp[STRACE_MAX_PREDS];
+	struct strace_pred_tab *tab;
 
-	for (int i=0; i<count; i++) {
-		// get syscall num first
-		rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-		switch(sysarg_map[push_strace_data (NULL, *((u64*)buff), 0,0,0,0)].sysarg_cnt) {
-			case 0:
-				continue;
-			case 1:
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				break;
-			case 2:
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				break;
-			case 3:
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				break;
-			case 4:
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				rbytes += _trace_buffer_read(filep, buff+rbytes, sizeof(u64));
-				break;
-			default:
-				return -EINVAL;
-		}
-	}
+	if (syscall_num < 0 || syscall_num >= STRACE_NR_SYSCALLS || n < 0 || n > STRACE_MAX_PREDS)
+		return -EINVAL;
+	if (n && !is_valid_mem_range((u64)preds, n * sizeof(struct strace_pred), 1))
+		return -EBADMEM;
+
+	// compile first, the table is left alone on bad input
+	for (int i = 0; i < n; i++) {
+		struct strace_pred *p = &preds[i];
+
+		if (p->param < 1 || p->param > 4)
+			return -EINVAL;
+		cp[i].param = p->param - 1;
+		switch (p->op) {
+			case STRACE_PRED_EQ:
+				cp[i].mask = 0;
+				cp[i].lo = p->a;
+				cp[i].span = 0;
+			break;
+			case STRACE_PRED_RANGE:
+				if (p->a > p->b)
+					return -EINVAL;
+				cp[i].mask = 0;
+				cp[i].lo = p->a;
+				cp[i].span = p->b - p->a;
+			break;
+			case STRACE_PRED_MASK:
+				cp[i].mask = p->a;
+				cp[i].lo = 0;
+				cp[i].span = (u64)-1;
+			break;
+			default:
+				return -EINVAL;
+		}
+	}
+
+	// this struct is unallocated at start hence allocate it
+	if (st_head == NULL) {
+		st_head = os_alloc(sizeof(struct strace_head));
+		if (st_head == NULL)
+			// can not allocate
+			return -EINVAL;
+
+		current->st_md_base = st_head;
+
+		// initialize
+		st_head->tracing_mode = FILTERED_TRACING;
+		st_head->is_traced    = 0;
+		strace_head_init(st_head);
+	}
+
+	if (!(tab = st_head->preds)) {
+		if (!n)
+			return 0;
+		if (NULL == (tab = os_page_alloc(OS_DS_REG)))
+			return -ENOMEM;
+		memset((char *)tab, 0, sizeof(*tab));
+		st_head->preds = tab;
+	}
+	if (tab->used - tab->n[syscall_num] + n > STRACE_PRED_POOL)
+		return -ENOSPC;
+
+	// close the gap left by the old predicates, then append the new ones
+	if (tab->n[syscall_num]) {
+		u32 start = tab->start[syscall_num], old = tab->n[syscall_num];
+
+		for (u32 i = start; i + old < tab->used; i++)
+			tab->pred[i] = tab->pred[i + old];
+		for (int s = 0; s < STRACE_NR_SYSCALLS; s++)
+			if (tab->n[s] && tab->start[s] > start)
+				tab->start[s] -= old;
+		tab->used -= old;
+		tab->n[syscall_num] = 0;
+	}
+	for (int i = 0; i < n; i++)
+		tab->pred[tab->used + i] = cp[i];
+	tab->start[syscall_num] = tab->used;
+	tab->used += n;
+	// published last: perform_tracing() only looks at n
+	tab->n[syscall_num] = n;
+
+	return 0;
+}
+
+// records are taken oldest first across the producers of the buffer
+/* Move up to 'nrec' whole records into buff without exceeding 'size'
+ * bytes; regular records are copied straight from the ring, compact ones
+ * are expanded on the way. Returns the number of records, their total
+ * size in *bytes.
+ */
+static int trace_drain(struct file *filep, char *buff, u32 size, u64 nrec, u32 *bytes)
+{
+	// big enough for compact strace records and for ftrace records
+	u64 rec[(STRACE_COMPACT_MAX > FTRACE_REC_MAX ? STRACE_COMPACT_MAX : FTRACE_REC_MAX) / sizeof(u64) + 1];
+	u64 out[STRACE_REC_MAX / sizeof(u64)];
+	struct trace_ring *ring;
+	u32 rbytes = 0;
+	int n = 0;
+
+	while (n < nrec) {
+		int len = trace_buffer_peek(filep, buff+rbytes, size-rbytes, &ring);
+
+		if (len == -ENOSPC && size-rbytes < sizeof(rec))
+			// may be a compact record that expands to what still fits
+			len = trace_buffer_peek(filep, (char *)rec, sizeof(rec), &ring);
+		if (len <= 0)
+			break;
+
+		u8 *first = (u8 *)(len <= size-rbytes ? buff+rbytes : (char *)rec);
+		if (*first & STRACE_REC_COMPACT) {
+			u64 base = ring->dec_base;
+			u32 olen;
+
+			if (first != (u8 *)rec)
+				memcpy((char *)rec, (char *)first, len);
+			olen = strace_decode_compact((u8 *)rec, &base, (char *)out);
+			if (olen > size-rbytes)
+				break;
+			memcpy(buff+rbytes, (char *)out, olen);
+			ring->dec_base = base;
+			trace_buffer_consume(ring, len);
+			rbytes += olen;
+		} else {
+			if (first == (u8 *)rec)
+				break;	// regular record too big for the rest of buff
+			trace_buffer_consume(ring, len);
+			rbytes += len;
+		}
+		n++;
+	}
+	*bytes = rbytes;
+	return n;
+}
+
+// records are expected to fit count * STRACE_REC_MAX bytes, returns bytes
+int sys_read_strace(struct file *filep, char *buff, u64 count)
+{
+	u32 size, rbytes;
+
+	if (count > (u32)-1 / STRACE_REC_MAX)
+		return -EINVAL;
+	size = count * STRACE_REC_MAX;
+	if (!is_valid_mem_range((u64)buff, size, 2))
+		return -EBADMEM;
+
+	trace_drain(filep, buff, size, count, &rbytes);
 	return rbytes;
 }
 
+/* Fill buff with as many whole records as fit in 'size' bytes, oldest
+ * first, and return how many were copied or -EBADMEM
+ */
+int sys_read_strace_batch(struct file *filep, char *buff, u32 size)
+{
+	u32 rbytes;
+
+	if (!filep || !filep->trace_buffer)
+		return -EINVAL;
+	if (!is_valid_mem_range((u64)buff, size, 2))
+		return -EBADMEM;
+
+	return trace_drain(filep, buff, size, (u64)-1, &rbytes);
+}
+
+/* copy the latency histogram of 'syscall_num' kept with STRACE_HISTOGRAM
+ * into buff; returns the number of bytes copied, 0 if it has no samples,
+ * or -EBADMEM
+ */
+int sys_read_strace_hist(struct exec_context *current, int syscall_num, char *buff)
+{
+	struct strace_head *st_head = current->st_md_base;
+
+	if (!st_head || !st_head->hist || syscall_num < 0 || syscall_num >= STRACE_NR_SYSCALLS)
+		return -EINVAL;
+	if (!st_head->hist[syscall_num])
+		return 0;
+	if (!is_valid_mem_range((u64)buff, sizeof(struct strace_hist), 2))
+		return -EBADMEM;
+
+	memcpy(buff, (char *)st_head->hist[syscall_num], sizeof(struct strace_hist));
+	return sizeof(struct strace_hist);
+}
+
+/* copy the whole COUNT_TRACING table, indexed by syscall number, into
+ * buff; returns the number of bytes copied or -EBADMEM
+ */
+int sys_read_strace_counts(struct exec_context *current, char *buff)
+{
+	struct strace_head *st_head = current->st_md_base;
+
+	if (!st_head || !st_head->counts)
+		return -EINVAL;
+	if (!is_valid_mem_range((u64)buff, STRACE_COUNT_SIZE, 2))
+		return -EBADMEM;
+
+	memcpy(buff, (char *)st_head->counts, STRACE_COUNT_SIZE);
+	return STRACE_COUNT_SIZE;
+}
+
 int sys_start_strace(struct exec_context *current, int fd, int tracing_mode)
 {
 	struct strace_head *st_head = current->st_md_base;
@@ -549,14 +1333,31 @@ int sys_start_strace(struct exec_context *current, int fd, int tracing_mode)
 			return -EINVAL;
 		current->st_md_base = st_head;
 
-		st_head->count = 0;
-		st_head->next = NULL;
-		st_head->last = NULL;
+		strace_head_init(st_head);
+	}
+
+	int mode = tracing_mode & STRACE_MODE_MASK;
+	int flags = tracing_mode & ~STRACE_MODE_MASK;
+
+	// tables first, tracing must not start without them
+	if ((flags & STRACE_HISTOGRAM) && !st_head->hist) {
+		st_head->hist = os_page_alloc(OS_DS_REG);
+		if (st_head->hist == NULL)
+			return -EINVAL;
+		memset((char *)st_head->hist, 0, STRACE_NR_SYSCALLS * sizeof(struct strace_hist *));
+	}
+	if (mode == COUNT_TRACING && !st_head->counts) {
+		st_head->counts = os_page_alloc(OS_DS_REG);
+		if (st_head->counts == NULL)
+			return -EINVAL;
+		memset((char *)st_head->counts, 0, STRACE_COUNT_SIZE);
 	}
 
 	st_head->is_traced = 1;
 	st_head->strace_fd = fd;	// assuming a valid fd
-	st_head->tracing_mode = tracing_mode;
+	st_head->tracing_mode = mode;
+	st_head->flags = flags;
+	st_head->in_syscall = 0;
 
 	return 0;
 }
@@ -569,17 +1370,18 @@ int sys_end_strace(struct exec_context *current)
 	struct strace_head *st_head = current->st_md_base;
 
 	if (st_head) {
-		int st_cnt = st_head->count;
-		if (st_cnt) {
-			struct strace_info *t = st_head->next;
-			while (st_cnt) {
-				st_head->next = t->next;
-				os_free(t, sizeof(struct strace_info));
-				t = st_head->next;
-				st_cnt--;
-			}
+		if (st_head->hist) {
+			for (int i = 0; i < STRACE_NR_SYSCALLS; i++)
+				if (st_head->hist[i])
+					os_free(st_head->hist[i], sizeof(struct strace_hist));
+			os_page_free(OS_DS_REG, st_head->hist);
 		}
-
+		if (st_head->counts)
+			os_page_free(OS_DS_REG, st_head->counts);
+		if (st_head->limits)
+			os_page_free(OS_DS_REG, st_head->limits);
+		if (st_head->preds)
+			os_page_free(OS_DS_REG, st_head->preds);
 		os_free(st_head, sizeof(struct strace_head));
 		current->st_md_base = NULL;
 	}
@@ -594,31 +1396,202 @@ int sys_end_strace(struct exec_context *current)
 ///////////////////////////////////////////////////////////////////////////
 
 
+// the prologue displaced by the patch, emulated by handle_ftrace_fault()
+static const u8 ftrace_prologue[FTRACE_PATCH_LEN] = {PUSH_RBP_OPCODE, 0x48, 0x89, 0xe5};
+
+static int ftrace_patch(struct exec_context *ctx, struct ftrace_info *info)
+{
+	struct mm_segment *code = &ctx->mms[MM_SEG_CODE];
+	u8 *text = (u8 *)info->faddr;
+
+	if (info->enabled)
+		return 0;
+	if (info->faddr < code->start || info->faddr + FTRACE_PATCH_LEN > code->next_free)
+		return -EINVAL;
+
+	for (int i = 0; i < FTRACE_PATCH_LEN; i++)
+		if (text[i] != ftrace_prologue[i])
+			return -EINVAL;
+	for (int i = 0; i < FTRACE_PATCH_LEN; i++) {
+		info->code_backup[i] = text[i];
+		text[i] = INV_OPCODE;
+	}
+	info->enabled = 1;
+	return 0;
+}
+
+static void ftrace_unpatch(struct ftrace_info *info)
+{
+	u8 *text = (u8 *)info->faddr;
+
+	if (!info->enabled)
+		return;
+	for (int i = 0; i < FTRACE_PATCH_LEN; i++)
+		text[i] = info->code_backup[i];
+	info->enabled = 0;
+}
+
+#define FTRACE_TOMB ((struct ftrace_info *)1)
+
+static inline struct ftrace_info **ftrace_slot(struct ftrace_info ***pages, u32 i)
+{
+	return &pages[i / FTRACE_SLOTS_PER_PAGE][i % FTRACE_SLOTS_PER_PAGE];
+}
+
+static inline u32 ftrace_hash(unsigned long faddr, u32 nslots)
+{
+	return (u32)((faddr * 0x9E3779B97F4A7C15UL) >> 32) & (nslots - 1);
+}
+
+static void ftrace_free_pages(struct ftrace_info ***pages, u32 nslots)
+{
+	u32 npages = nslots / FTRACE_SLOTS_PER_PAGE;
+
+	for (u32 i = 0; i < npages; i++)
+		if (pages[i])
+			os_page_free(OS_DS_REG, pages[i]);
+	os_free(pages, npages * sizeof(struct ftrace_info **));
+}
+
+static struct ftrace_info *ftrace_find(struct ftrace_head *ft_head, unsigned long faddr)
+{
+	u32 mask = ft_head->nslots - 1;
+	struct ftrace_info *info;
+
+	if (!ft_head->nslots)
+		return NULL;
+	for (u32 i = ftrace_hash(faddr, ft_head->nslots); (info = *ftrace_slot(ft_head->pages, i)); i = (i + 1) & mask)
+		if (info != FTRACE_TOMB && info->faddr == faddr)
+			return info;
+	return NULL;
+}
+
+// rehash into 'nslots' slots, dropping the tombstones
+static int ftrace_resize(struct ftrace_head *ft_head, u32 nslots)
+{
+	u32 npages = nslots / FTRACE_SLOTS_PER_PAGE;
+	struct ftrace_info ***pages;
+
+	if (NULL == (pages = os_alloc(npages * sizeof(struct ftrace_info **))))
+		return -EINVAL;
+	for (u32 i = 0; i < npages; i++)
+		pages[i] = NULL;
+	for (u32 i = 0; i < npages; i++) {
+		if (NULL == (pages[i] = os_page_alloc(OS_DS_REG))) {
+			ftrace_free_pages(pages, nslots);
+			return -EINVAL;
+		}
+		memset((char *)pages[i], 0, FTRACE_SLOTS_PER_PAGE * sizeof(struct ftrace_info *));
+	}
+
+	for (u32 i = 0; i < ft_head->nslots; i++) {
+		struct ftrace_info *info = *ftrace_slot(ft_head->pages, i);
+		u32 j;
+
+		if (!info || info == FTRACE_TOMB)
+			continue;
+		for (j = ftrace_hash(info->faddr, nslots); *ftrace_slot(pages, j); j = (j + 1) & (nslots - 1))
+			;
+		*ftrace_slot(pages, j) = info;
+	}
+
+	if (ft_head->nslots)
+		ftrace_free_pages(ft_head->pages, ft_head->nslots);
+	ft_head->pages = pages;
+	ft_head->nslots = nslots;
+	ft_head->tombs = 0;
+	return 0;
+}
+
+// 'info->faddr' must not be in the table yet
+static int ftrace_insert(struct ftrace_head *ft_head, struct ftrace_info *info)
+{
+	u32 i;
+
+	// keep the load, tombstones included, at most one half
+	if ((ft_head->count + ft_head->tombs + 1) * 2 > ft_head->nslots) {
+		u32 nslots = ft_head->nslots ? ft_head->nslots : FTRACE_SLOTS_PER_PAGE;
+
+		while ((ft_head->count + 1) * 2 > nslots)
+			nslots *= 2;
+		if (ftrace_resize(ft_head, nslots))
+			return -EINVAL;
+	}
+
+	for (i = ftrace_hash(info->faddr, ft_head->nslots); ; i = (i + 1) & (ft_head->nslots - 1)) {
+		struct ftrace_info **slot = ftrace_slot(ft_head->pages, i);
+
+		if (*slot == FTRACE_TOMB)
+			ft_head->tombs--;
+		if (!*slot || *slot == FTRACE_TOMB) {
+			*slot = info;
+			break;
+		}
+	}
+	ft_head->count += 1;
+	return 0;
+}
+
+static void ftrace_remove(struct ftrace_head *ft_head, struct ftrace_info *info)
+{
+	u32 i = ftrace_hash(info->faddr, ft_head->nslots);
+
+	while (*ftrace_slot(ft_head->pages, i) != info)
+		i = (i + 1) & (ft_head->nslots - 1);
+	*ftrace_slot(ft_head->pages, i) = FTRACE_TOMB;
+	ft_head->tombs++;
+	ft_head->count -= 1;
+}
+
+// trace buffer behind info->fd, NULL if the fd has been closed or reused
+static inline struct file *ftrace_file(struct exec_context *ctx, struct ftrace_info *info)
+{
+	struct file *fptr = ctx->files[info->fd];
+
+	if (!fptr || fptr->type != TRACE_BUFFER || !fptr->trace_buffer)
+		return NULL;
+	return fptr;
+}
+
 long do_ftrace(struct exec_context *ctx, unsigned long faddr, long action, long nargs, int fd_trace_buffer)
 {
 	struct ftrace_head *ft_head = ctx->ft_md_base;
-	if (ft_head == NULL)
-		return -EINVAL;
+	// this struct is unallocated at start hence allocate it
+	if (ft_head == NULL) {
+		if (action != ADD_FTRACE)
+			return -EINVAL;
+		ft_head = os_alloc(sizeof(struct ftrace_head));
+		if (ft_head == NULL)
+			return -EINVAL;
+		ft_head->count = 0;
+		ft_head->tombs = 0;
+		ft_head->nslots = 0;
+		ft_head->pages = NULL;
+		ft_head->nstacks = 0;
+		ft_head->stacks = NULL;
+		ft_head->tramp_addr = 0;
+		ft_head->shadow_top = 0;
+		ft_head->shadow = NULL;
+		ctx->ft_md_base = ft_head;
+	}
 
-	struct ftrace_info *ptr = ft_head->next;
-	long ft_cnt 		= ft_head->count;
+	struct ftrace_info *ptr = ftrace_find(ft_head, faddr);
+
+	// every action but an addition needs the fcall to be added already
+	if (action != ADD_FTRACE && !ptr)
+		return -EINVAL;
 
 	switch(action) {
 		case ADD_FTRACE:
 		{
 			// check if ft is already enabled for the fcall
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					return -EINVAL;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-
-			// first check if the current count is within max
-			if (ft_head->count + 1 > FTRACE_MAX)
+			if (ptr || nargs < 0 || nargs > MAX_ARGS)
+				return -EINVAL;
+			// the fault path indexes files[] with it
+			if (fd_trace_buffer < 0 || fd_trace_buffer >= MAX_OPEN_FILES ||
+			    !ctx->files[fd_trace_buffer] || ctx->files[fd_trace_buffer]->type != TRACE_BUFFER)
 				return -EINVAL;
 
-			// fcall not traced hence add: at head or tail
 			ptr = os_alloc(sizeof(struct ftrace_info));
 			if (ptr == NULL)
 				return -EINVAL;
@@ -626,120 +1599,61 @@ long do_ftrace(struct exec_context *ctx, unsigned long faddr, long action, long
 			ptr->num_args = nargs;
 			ptr->fd       = fd_trace_buffer;
 			ptr->capture_backtrace = 0;
-			ptr->next = NULL;
-
-			if (ft_head->count) {
-				// at the tail
-				ft_head->last->next = ptr;
-				ft_head->last = ptr;
-			} else {
-				// first addition
-				ft_head->last = ft_head->next = ptr;
+			ptr->bt_depth = FTRACE_BT_DEPTH;
+			ptr->trace_exit = 0;
+			ptr->enabled  = 0;
+			memset((char *)&ptr->limit, 0, sizeof(ptr->limit));
+			ptr->hits     = 0;
+			ptr->cycles   = 0;
+
+			if (ftrace_insert(ft_head, ptr)) {
+				os_free(ptr, sizeof(struct ftrace_info));
+				return -EINVAL;
 			}
-			ft_head->count += 1;
 		}
 		break;
 		case REMOVE_FTRACE:
 		{
-			// check if ft is actually enabled for the fcall
-			struct ftrace_info *t = NULL;
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					break;
-				// 't' will always be a node behind 'ptr'
-				t = ptr;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-			if (ft_cnt) {
-				// fcall traced hence disable it
-				// remove its ftrace_info entry: head, mid, end
-				if (ptr == ft_head->next) {
-					// head deletion
-					ft_head->next = ptr->next;
-				} else if (ptr == ft_head->last) {
-					// tail deletion
-					ft_head->last = t;
-				} else {
-					t->next = ptr->next;
-				}
-				os_free(ptr, sizeof(struct ftrace_info));
-				ft_head->count -= 1;
-			} else
-				// trying to remove something i.e. not present
-				return -EINVAL;
+			// fcall traced hence disable it
+			ftrace_unpatch(ptr);
+			ftrace_remove(ft_head, ptr);
+			os_free(ptr, sizeof(struct ftrace_info));
 		}
 		break;
 		case ENABLE_FTRACE:
-		{
-			// check if ft is already enabled for the fcall
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					break;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-			if (ft_cnt) {
-				// handle
-
-			} else
-				// trying to trace func i.e. not added yet
-				return -EINVAL;
-		}
-		break;
+			return ftrace_patch(ctx, ptr);
 		case DISABLE_FTRACE:
-		{
-			// check if ft is already enabled for the fcall
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					break;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-			if (ft_cnt) {
-				// handle
-
-			} else
-				// trying to trace func i.e. not added yet
-				return -EINVAL;
-		}
+			ftrace_unpatch(ptr);
 		break;
 		case ENABLE_BACKTRACE:
-		{
-			// check if ft is already enabled for the fcall
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					break;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-			if (ft_cnt) {
-				// handle
-				ptr->capture_backtrace = 1;
-
-			} else
-				// trying to trace func i.e. not added yet
+			// nargs is the depth here, 0 for the default
+			if (nargs < 0 || nargs > FTRACE_BT_MAX)
 				return -EINVAL;
-		}
+			ptr->bt_depth = nargs ? nargs : FTRACE_BT_DEPTH;
+			ptr->capture_backtrace = 1;
 		break;
 		case DISABLE_BACKTRACE:
-		{
-			// check if ft is already enabled for the fcall
-			while (ft_cnt) {
-				if (faddr == ptr->faddr)
-					break;
-				ptr = ptr->next;
-				ft_cnt--;
-			}
-			if (ft_cnt) {
-				// handle
-				ptr->capture_backtrace = 0;
-				// disable ftrace as well
-
-			} else
-				// trying to trace func i.e. not added yet
+			ptr->capture_backtrace = 0;
+		break;
+		case ENABLE_FTRACE_EXIT:
+			ptr->trace_exit = 1;
+		break;
+		case DISABLE_FTRACE_EXIT:
+			// calls in flight still return through the trampoline
+			ptr->trace_exit = 0;
+		break;
+		case SAMPLE_FTRACE:
+			if (nargs < 0)
 				return -EINVAL;
-		}
+			ptr->limit.sample_n = nargs;
+			ptr->limit.sample_cnt = 0;
+		break;
+		case RATE_FTRACE:
+			if (nargs < 0)
+				return -EINVAL;
+			ptr->limit.rate = nargs;
+			ptr->limit.tokens = nargs;
+			ptr->limit.last_ts = trace_clock();
 		break;
 		default:
 			return -EINVAL;
@@ -749,19 +1663,331 @@ long do_ftrace(struct exec_context *ctx, unsigned long faddr, long action, long
 
 }
 
+// the return address stored at user stack address 'slot', looking
+// through the trampoline of calls hooked by ENABLE_FTRACE_EXIT
+static u64 ftrace_ret_at(struct ftrace_head *ft_head, u64 slot)
+{
+	u64 ret = *(u64 *)slot;
+
+	if (!ft_head->tramp_addr || ret != ft_head->tramp_addr)
+		return ret;
+	for (u32 i = ft_head->shadow_top; i; i--)
+		if (ft_head->shadow[i-1].slot == slot)
+			return ft_head->shadow[i-1].ret;
+	return ret;
+}
+
+/* Walk the frame pointers of the faulting function's callers: frames[0]
+ * is faddr, frames[1] the return address pushed by its call; stops at
+ * END_ADDR, at a frame outside the user stack or after 'max' frames
+ */
+static u32 ftrace_backtrace(struct exec_context *ctx, struct ftrace_head *ft_head, struct user_regs *regs,
+			    u64 faddr, u64 *frames, u32 max)
+{
+	struct mm_segment *stack = &ctx->mms[MM_SEG_STACK];
+	u64 rbp = regs->rbp;
+	u64 ret = ftrace_ret_at(ft_head, regs->entry_rsp);
+	u32 n = 0;
+
+	frames[n++] = faddr;
+	if (n < max && ret != END_ADDR)
+		frames[n++] = ret;
+	else
+		return n;
+
+	while (n < max && rbp >= stack->start && rbp + 2 * sizeof(u64) <= stack->end) {
+		ret = ftrace_ret_at(ft_head, rbp + sizeof(u64));
+		if (ret == END_ADDR)
+			break;
+		frames[n++] = ret;
+		rbp = ((u64 *)rbp)[0];
+	}
+	return n;
+}
+
+// Whether the reader of tb may not get the definition of 'st' before the
+// records using it: it went to another buffer, or records have been
+// overwritten or dropped since and it is no longer in the ring
+static int ftrace_stack_lost(struct ftrace_stack *st, struct trace_buffer_info *tb, struct trace_ring *ring)
+{
+	u32 r, w;
+
+	if (st->emit_tb != tb->id || &tb->ring[st->emit_ring] != ring)
+		return 1;
+	if (st->emit_dropped == ring->hdr->dropped)
+		return 0;
+	// a definition consumed by the reader also counts as lost here
+	r = __atomic_load_n(&ring->hdr->r_offset, __ATOMIC_ACQUIRE);
+	w = ring->hdr->w_offset;
+	if (st->emit_pos - r >= w - r)
+		return 1;
+	st->emit_dropped = ring->hdr->dropped;
+	return 0;
+}
+
+/* id of the stack in 'frames', 0 if the table is full; the stack's
+ * definition is pushed to fptr before the first record using it and
+ * again whenever it may have been lost, see ftrace_stack_lost()
+ */
+static u16 ftrace_stack_id(struct ftrace_head *ft_head, u64 *frames, u32 depth, struct file *fptr)
+{
+	struct trace_buffer_info *tb = fptr->trace_buffer;
+	struct trace_ring *ring;
+	struct ftrace_stack *st;
+	u64 hash = 0xcbf29ce484222325UL;
+	u32 i;
+
+	if (!ft_head->stacks) {
+		if (NULL == (ft_head->stacks = os_page_alloc(OS_DS_REG)))
+			return 0;
+		memset((char *)ft_head->stacks, 0, FTRACE_STACK_SLOTS * sizeof(struct ftrace_stack *));
+	}
+
+	for (i = 0; i < depth; i++)
+		hash = (hash ^ frames[i]) * 0x100000001b3UL;
+
+	for (i = hash & (FTRACE_STACK_SLOTS - 1); (st = ft_head->stacks[i]); i = (i + 1) & (FTRACE_STACK_SLOTS - 1)) {
+		u32 j;
+
+		if (st->hash != hash || st->depth != depth)
+			continue;
+		for (j = 0; j < depth && st->frames[j] == frames[j]; j++)
+			;
+		if (j == depth)
+			break;
+	}
+	if (!st) {
+		// keep a quarter free so that probes stay short
+		if ((ft_head->nstacks + 1) * 4 > FTRACE_STACK_SLOTS * 3)
+			return 0;
+		if (NULL == (st = os_alloc(sizeof(struct ftrace_stack))))
+			return 0;
+		st->hash = hash;
+		st->depth = depth;
+		st->emit_tb = 0;
+		for (u32 j = 0; j < depth; j++)
+			st->frames[j] = frames[j];
+		ft_head->stacks[i] = st;
+		ft_head->nstacks++;
+	}
+
+	// the records of this context go to its own ring
+	if ((ring = producer_ring(tb)) && ftrace_stack_lost(st, tb, ring)) {
+		struct {
+			struct ftrace_rec_hdr hdr;
+			u64 frames[FTRACE_BT_MAX];
+		} rec;
+
+		rec.hdr.len = sizeof(rec.hdr) + depth * sizeof(u64);
+		rec.hdr.flags = FTRACE_REC_STACK;
+		rec.hdr.num_args = depth;
+		rec.hdr.stack_id = i + 1;
+		for (u32 j = 0; j < depth; j++)
+			rec.frames[j] = frames[j];
+
+		tb->rec_len = strace_rec_len;
+		st->emit_pos = ring->hdr->w_offset;
+		// retried on the next hit if the buffer is full
+		if (trace_buffer_push(fptr, (char *)&rec, rec.hdr.len) > 0) {
+			st->emit_tb = tb->id;
+			st->emit_ring = ring - tb->ring;
+			st->emit_dropped = ring->hdr->dropped;
+		}
+	}
+	return i + 1;
+}
+
+// Map the trampoline page and allocate the shadow stack on first use
+static int ftrace_exit_setup(struct exec_context *ctx, struct ftrace_head *ft_head)
+{
+	void *page;
+	long addr;
+
+	if (!ft_head->shadow) {
+		if (NULL == (ft_head->shadow = os_page_alloc(OS_DS_REG)))
+			return -ENOMEM;
+		ft_head->shadow_top = 0;
+	}
+	if (ft_head->tramp_addr)
+		return 0;
+
+	if (NULL == (page = os_page_alloc(USER_REG)))
+		return -ENOMEM;
+	memset((char *)page, INV_OPCODE, TRACE_BUFFER_PAGE_SIZE);
+
+	addr = vm_area_map(ctx, 0, TRACE_BUFFER_PAGE_SIZE, PROT_READ, 0);
+	if (addr <= 0 || tb_map_page(ctx, addr, page, TB_PTE_P | TB_PTE_U)) {
+		if (addr > 0)
+			vm_area_unmap(ctx, addr, TRACE_BUFFER_PAGE_SIZE);
+		tb_page_put(page);
+		return -ENOMEM;
+	}
+	// the page now belongs to the mapping alone
+	tb_page_put(page);
+	ft_head->tramp_addr = addr;
+	return 0;
+}
+
+// Divert the return of the call entering info->faddr to the trampoline
+static struct ftrace_shadow *ftrace_hook_return(struct exec_context *ctx, struct ftrace_head *ft_head,
+						struct ftrace_info *info, struct user_regs *regs)
+{
+	struct ftrace_shadow *sh;
+
+	if (ftrace_exit_setup(ctx, ft_head) || ft_head->shadow_top == FTRACE_SHADOW_MAX)
+		return NULL;
+
+	sh = &ft_head->shadow[ft_head->shadow_top++];
+	sh->slot = regs->entry_rsp;
+	sh->ret = *(u64 *)sh->slot;
+	sh->faddr = info->faddr;
+	*(u64 *)sh->slot = ft_head->tramp_addr;
+	return sh;
+}
+
+// A traced call returned into the trampoline: record it and resume at
+// the real return address
+static long ftrace_return(struct exec_context *ctx, struct ftrace_head *ft_head, struct user_regs *regs)
+{
+	u64 now = trace_clock();
+	struct ftrace_shadow *sh = NULL;
+	struct ftrace_info *info;
+	struct file *fptr;
+
+	// frames skipped by a non-local exit never return, drop them
+	while (ft_head->shadow_top) {
+		sh = &ft_head->shadow[--ft_head->shadow_top];
+		if (sh->slot + sizeof(u64) == regs->entry_rsp)
+			break;
+		sh = NULL;
+	}
+	if (!sh)
+		return -EINVAL;
+
+	info = ftrace_find(ft_head, sh->faddr);
+	if (info && (fptr = ftrace_file(ctx, info))) {
+		struct {
+			struct ftrace_rec_hdr hdr;
+			u64 faddr;
+			u64 args[2];
+		} rec;
+
+		rec.hdr.len = sizeof(rec);
+		rec.hdr.flags = FTRACE_REC_EXIT;
+		rec.hdr.num_args = 2;
+		rec.hdr.stack_id = 0;
+		rec.faddr = sh->faddr;
+		rec.args[0] = regs->rax;
+		rec.args[1] = now - sh->entry_ts;
+
+		fptr->trace_buffer->rec_len = strace_rec_len;
+		trace_buffer_push(fptr, (char *)&rec, rec.hdr.len);
+	}
+
+	regs->entry_rip = sh->ret;
+	return 0;
+}
+
 //Fault handler
 long handle_ftrace_fault(struct user_regs *regs)
 {
-        return 0;
+	struct exec_context *ctx = get_current_ctx();
+	struct ftrace_head *ft_head = ctx->ft_md_base;
+	struct ftrace_info *info;
+	struct ftrace_shadow *sh = NULL;
+	u64 start = trace_clock();
+	struct file *fptr;
+
+	if (ft_head && ft_head->tramp_addr && regs->entry_rip == ft_head->tramp_addr)
+		return ftrace_return(ctx, ft_head, regs);
+
+	if (!ft_head || !(info = ftrace_find(ft_head, regs->entry_rip)) || !info->enabled)
+		return -EINVAL;
+
+	fptr = ftrace_file(ctx, info);
+	if (fptr && !trace_limit_pass(&info->limit)) {
+		trace_buffer_skip(fptr);
+		fptr = NULL;	// neither record nor hook the return
+	}
+	if (fptr) {
+		u64 args[MAX_ARGS] = {regs->rdi, regs->rsi, regs->rdx, regs->rcx, regs->r8};
+		struct {
+			struct ftrace_rec_hdr hdr;
+			u64 faddr;
+			u64 args[MAX_ARGS];
+		} rec;
+
+		rec.hdr.len = sizeof(rec.hdr) + (1 + info->num_args) * sizeof(u64);
+		rec.hdr.flags = 0;
+		rec.hdr.num_args = info->num_args;
+		rec.hdr.stack_id = 0;
+		rec.faddr = info->faddr;
+		for (u32 i = 0; i < info->num_args; i++)
+			rec.args[i] = args[i];
+
+		if (info->capture_backtrace) {
+			u64 frames[FTRACE_BT_MAX];
+			u32 depth = ftrace_backtrace(ctx, ft_head, regs, info->faddr, frames, info->bt_depth);
+
+			rec.hdr.stack_id = ftrace_stack_id(ft_head, frames, depth, fptr);
+		}
+
+		// same length prefix as strace records
+		fptr->trace_buffer->rec_len = strace_rec_len;
+		trace_buffer_push(fptr, (char *)&rec, rec.hdr.len);
+	}
+
+	if (info->trace_exit && fptr)
+		sh = ftrace_hook_return(ctx, ft_head, info, regs);
+
+	// emulate the displaced push %rbp; mov %rsp,%rbp and resume after it
+	regs->entry_rsp -= sizeof(u64);
+	*(u64 *)regs->entry_rsp = regs->rbp;
+	regs->rbp = regs->entry_rsp;
+	regs->entry_rip += FTRACE_PATCH_LEN;
+
+	info->hits++;
+	info->cycles += trace_clock() - start;
+	// taken last so that the duration excludes our own work
+	if (sh)
+		sh->entry_ts = trace_clock();
+	return 0;
 }
 
 
+// returns the number of bytes read, 'count' is in records and buff
+// must hold count * FTRACE_REC_MAX bytes
 int sys_read_ftrace(struct file *filep, char *buff, u64 count)
 {
-	if (!is_valid_mem_range((u64)buff, count, 2))
+	u32 size, rbytes;
+
+	if (count > (u32)-1 / FTRACE_REC_MAX)
+		return -EINVAL;
+	size = count * FTRACE_REC_MAX;
+	if (!is_valid_mem_range((u64)buff, size, 2))
 		return -EBADMEM;
 
-	return 0;
+	trace_drain(filep, buff, size, count, &rbytes);
+	return rbytes;
 }
 
+/* copy the hit count and handler overhead of the function at faddr into
+ * buff as a struct ftrace_stats; returns its size, -EINVAL if faddr is
+ * not traced or -EBADMEM
+ */
+int sys_read_ftrace_stats(struct exec_context *current, unsigned long faddr, char *buff)
+{
+	struct ftrace_head *ft_head = current->ft_md_base;
+	struct ftrace_info *info;
+	struct ftrace_stats stats;
+
+	if (!ft_head || !(info = ftrace_find(ft_head, faddr)))
+		return -EINVAL;
+	if (!is_valid_mem_range((u64)buff, sizeof(stats), 2))
+		return -EBADMEM;
 
+	stats.hits = info->hits;
+	stats.cycles = info->cycles;
+	memcpy(buff, (char *)&stats, sizeof(stats));
+	return sizeof(stats);
+}
@@ -9,18 +9,119 @@
 ///////////////////////////////////////////////////////////////////////
 ///////////////////// Trace buffer functionality ///////////////////// 
 /////////////////////////////////////////////////////////////////////
-#define TRACE_BUFFER_MAX_SIZE 4096
+#define TRACE_BUFFER_PAGE_SHIFT 12
+#define TRACE_BUFFER_PAGE_SIZE (1 << TRACE_BUFFER_PAGE_SHIFT)
+#define TRACE_BUFFER_MAX_SIZE TRACE_BUFFER_PAGE_SIZE	// default, one page
+#define TRACE_BUFFER_MAX_PAGES 256
 
-//Trace buffer information structure
-struct trace_buffer_info
+//Buffer size in pages is passed in the upper bits of the mode given to
+//sys_create_trace_buffer(); 0 means one page. It is rounded up to a
+//power of two.
+#define TRACE_BUFFER_PAGES_SHIFT 16
+#define TRACE_BUFFER_PAGES(n) ((n) << TRACE_BUFFER_PAGES_SHIFT)
+
+//Mode flag: when full, records pushed by strace/ftrace overwrite the
+//oldest whole records (flight recorder) instead of being dropped
+#define TRACE_BUFFER_OVERWRITE (1 << 8)
+//Mode flag: the buffer may be mapped with sys_map_trace_buffer(); compact
+//strace records in it are then self-contained (no STRACE_REC_DELTA)
+#define TRACE_BUFFER_MAPPABLE (1 << 9)
+
+//lseek() whence on a trace buffer: returns the number of dropped records
+#define TRACE_BUFFER_SEEK_DROPPED 3
+//lseek() whence: returns the number of events skipped by sampling or
+//rate limits (see struct trace_limit)
+#define TRACE_BUFFER_SEEK_SKIPPED 4
+
+//Every producer context (process) pushing records into a buffer gets its
+//own single-producer/single-consumer ring; readers merge them by time.
+//Ring 0 belongs to the creator and also holds raw trace_buffer_write()
+//data. Once all rings are taken, a ring whose records have all been read
+//passes to the next new producer.
+#define TRACE_BUFFER_PRODUCERS 4
+
+//Per-ring part of the header page. Offsets are free-running: fill level
+//is w_offset - r_offset and the position in the ring is
+//offset & (size - 1). The producer advances w_offset, the consumer
+//r_offset, each with release ordering.
+struct trace_ring_shared
 {
-	u8* buff;
 	u32 r_offset;
 	u32 w_offset;
-	u32 is_full;
+	u32 pid;	// producer, 0 while the ring is unused
+	u32 rsvd;
+	u64 dropped;	// records dropped or overwritten
+	u64 skipped;	// events not recorded because of a trace_limit
+};
+
+//Header page of a trace buffer, shared with a consumer that maps it
+//with sys_map_trace_buffer(). Ring i is mapped at
+//TRACE_BUFFER_PAGE_SIZE + i * 2 * size from the start of the mapping.
+struct trace_buffer_shared
+{
+	u32 size;
+	u32 flags;
+	struct trace_ring_shared ring[TRACE_BUFFER_PRODUCERS];
+};
+
+//Records pushed by tracers are stored as a u64 timestamp followed by
+//the payload
+struct trace_ring
+{
+	u8** pages;	// npages pages, not necessarily contiguous; NULL if unused
+	u32 pid;
+	struct trace_ring_shared *hdr;
+	// last pointer argument written / read, base of compact strace deltas
+	u64 enc_base;
+	u64 dec_base;
+};
+
+//Trace buffer information structure
+struct trace_buffer_info
+{
+	u32 npages;	// per ring
+	u32 size;	// npages * TRACE_BUFFER_PAGE_SIZE
+	u32 mask;
+	u32 flags;	// TRACE_BUFFER_OVERWRITE, TRACE_BUFFER_MAPPABLE
+	struct trace_buffer_shared *hdr;
+	struct trace_ring ring[TRACE_BUFFER_PRODUCERS];
+	// length of the record payload at ring offset 'pos', set by the producer
+	u32 (*rec_len)(struct trace_buffer_info *tb, struct trace_ring *ring, u32 pos);
+	// user mapping made by sys_map_trace_buffer(), if any
+	u64 map_addr;
+	struct exec_context *map_ctx;
+	u64 id;	// unique across buffers, never reused
 };
 
+//Per-syscall / per-function overhead cap: record 1 in 'sample_n' events
+//and, if 'rate' is set, at most 'rate' events per 2^TRACE_RATE_SHIFT
+//cycles with bursts of up to 'rate' (token bucket). 0 disables either.
+#define TRACE_RATE_SHIFT 24
 
+struct trace_limit
+{
+	u32 sample_n;
+	u32 sample_cnt;
+	u32 rate;
+	u32 tokens;
+	u64 last_ts;
+};
+
+static inline u64 trace_clock(void)
+{
+	u32 lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((u64)hi << 32) | lo;
+}
+
+
+extern int trace_limit_pass(struct trace_limit *l);
+extern void trace_buffer_skip(struct file *fptr);
+extern int trace_buffer_push(struct file *fptr, char *rec, u32 len);
+extern int trace_buffer_peek(struct file *fptr, char *rec, u32 max, struct trace_ring **from);
+extern void trace_buffer_consume(struct trace_ring *ring, u32 len);
+extern long sys_map_trace_buffer(struct exec_context *current, int fd);
 extern int sys_create_trace_buffer(struct exec_context *current, int mode);
 extern void free_trace_buffer_info(struct trace_buffer_info *p_info);
 
@@ -29,28 +130,154 @@ extern void free_trace_buffer_info(struct trace_buffer_info *p_info);
 //////////////////////// strace functionality ///////////////////////// 
 ///////////////////////////////////////////////////////////////////////
 
-#define STRACE_MAX 16
+#define STRACE_NR_SYSCALLS 128	// traceable syscall numbers: [0, STRACE_NR_SYSCALLS)
+#define STRACE_FILTER_WORDS (STRACE_NR_SYSCALLS / 64)
 #define FULL_TRACING 0
 #define FILTERED_TRACING 1
+#define COUNT_TRACING 2	// no records, only per-syscall strace_count totals
+#define STRACE_MODE_MASK 0xff
+//Mode flags for sys_start_strace()
+#define STRACE_COMPACT   (1 << 8)	// store records in the compact encoding
+#define STRACE_LATENCY   (1 << 9)	// also record each syscall's exit
+#define STRACE_HISTOGRAM (1 << 10)	// only keep per-syscall latency histograms
 
 enum{
 	ADD_STRACE,
 	REMOVE_STRACE,
+	SAMPLE_STRACE,	// record 1 in arg calls of the syscall
+	RATE_STRACE,	// arg: trace_limit rate of the syscall
 	MAX_STRACE
 };
 
-struct strace_info{
-	int syscall_num;
-	struct strace_info *next;
+//sys_strace() action taking an argument, e.g. STRACE_ACTION(SAMPLE_STRACE, 100)
+#define STRACE_ARG_SHIFT 8
+#define STRACE_ACTION(action, arg) ((action) | ((arg) << STRACE_ARG_SHIFT))
+
+// how a recorded syscall argument should be decoded
+enum sysarg_type{
+	SYSARG_INT,
+	SYSARG_FD,
+	SYSARG_PTR,
+	SYSARG_SIZE,
+	SYSARG_FLAGS
+};
+
+struct sysarg{
+	u8 type;	// enum sysarg_type
+	const char *name;
+};
+
+struct syscall_meta{
+	const char *name;	// NULL if the syscall is not known to strace
+	u32 nargs;		// arguments recorded after the syscall number
+	struct sysarg args[4];
+};
+
+extern const struct syscall_meta syscall_meta[STRACE_NR_SYSCALLS];
+
+/* metadata of syscall 'num' or NULL if strace does not know it */
+static inline const struct syscall_meta *syscall_meta_get(u64 num)
+{
+	if (num >= STRACE_NR_SYSCALLS || !syscall_meta[num].name)
+		return NULL;
+	return &syscall_meta[num];
+}
+
+/* every strace record starts with this header; 'len' covers the header
+ * and the u64 arguments that follow it
+ */
+struct strace_rec_hdr{
+	u16 len;
+	u16 flags;
+	u32 syscall_num;
+};
+
+// strace_rec_hdr flags
+#define STRACE_REC_UNKNOWN (1 << 0)	// syscall not in syscall_meta[], no args
+#define STRACE_REC_DELTA   (1 << 1)	// compact: pointers relative to the last one
+#define STRACE_REC_EXIT    (1 << 2)	// args: return value, entry cycles, duration
+
+#define STRACE_REC_MAX (sizeof(struct strace_rec_hdr) + 4 * sizeof(u64))
+
+/* Compact records are kept in the buffer only and are expanded to the
+ * layout above by sys_read_strace():
+ *   u8 0x80 | len, u8 flags, varint syscall_num, varint args
+ * Pointer arguments are zigzag deltas from the previous pointer argument
+ * of the same producer when STRACE_REC_DELTA is set, INT arguments are
+ * zigzag encoded and the rest are plain. A regular record never has
+ * the top bit of its first byte set as 'len' is at most STRACE_REC_MAX.
+ */
+#define STRACE_REC_COMPACT 0x80
+#define STRACE_COMPACT_MAX (2 + 5 * 10)
+
+extern int strace_decode_compact(u8 *src, u64 *base, char *dst);
+
+#define STRACE_HIST_BUCKETS 32
+
+//Bucket i counts syscalls that took [2^i, 2^(i+1)) cycles, the last
+//bucket also counts everything longer
+struct strace_hist{
+	u32 bucket[STRACE_HIST_BUCKETS];
+};
+
+//Per-syscall totals kept in COUNT_TRACING mode
+struct strace_count{
+	u64 calls;
+	u64 cycles;	// time spent in the handler
+	u64 bytes;	// transferred by successful read() and write()
+};
+
+#define STRACE_COUNT_SIZE (STRACE_NR_SYSCALLS * sizeof(struct strace_count))
+
+//Argument predicates of sys_strace_filter(); all predicates given for a
+//syscall must hold for a call of it to be traced
+enum{
+	STRACE_PRED_EQ,		// param == a
+	STRACE_PRED_RANGE,	// a <= param <= b
+	STRACE_PRED_MASK,	// (param & a) == a
+};
+
+struct strace_pred{
+	u32 op;
+	u32 param;	// 1..4 for param1..param4
+	u64 a;
+	u64 b;
+};
+
+//Predicates compiled to one form: (v & mask) == mask && v - lo <= span
+struct strace_cpred{
+	u32 param;	// 0..3
+	u64 mask;
+	u64 lo;
+	u64 span;
+};
+
+#define STRACE_MAX_PREDS 4	// per syscall
+#define STRACE_PRED_POOL 64
+
+//Compiled predicates of syscall i are pred[start[i]] .. pred[start[i] + n[i] - 1]
+struct strace_pred_tab{
+	u8 start[STRACE_NR_SYSCALLS];
+	u8 n[STRACE_NR_SYSCALLS];
+	u32 used;
+	struct strace_cpred pred[STRACE_PRED_POOL];
 };
 
 struct strace_head{
-	int count;
+	int count;	// number of syscalls set in 'filter'
 	int is_traced;  
         int strace_fd;
         int tracing_mode;
-	struct strace_info *next;
-	struct strace_info *last;	
+	u64 filter[STRACE_FILTER_WORDS];	// one bit per traced syscall
+	int flags;	// STRACE_COMPACT, STRACE_LATENCY, STRACE_HISTOGRAM
+	// traced syscall whose handler is running, see perform_tracing_exit()
+	int in_syscall;
+	u64 entry_nr;
+	u64 entry_ts;
+	struct strace_hist **hist;	// page of STRACE_NR_SYSCALLS entries or NULL
+	struct strace_count *counts;	// page of STRACE_NR_SYSCALLS entries or NULL
+	struct trace_limit *limits;	// page of STRACE_NR_SYSCALLS entries or NULL
+	struct strace_pred_tab *preds;	// one page or NULL
 };
 
 struct file;
@@ -59,8 +286,13 @@ struct exec_context;
 extern int sys_start_strace(struct exec_context *current, int fd, int tracing_mode);
 extern int sys_end_strace(struct exec_context *current);
 extern int sys_read_strace(struct file *filep, char *buff, u64 count);
+extern int sys_read_strace_batch(struct file *filep, char *buff, u32 size);
 extern int sys_strace(struct exec_context *current, int syscall_num, int action);
+extern int sys_strace_filter(struct exec_context *current, int syscall_num, struct strace_pred *preds, int n);
 extern int perform_tracing(u64 syscall, u64 param1, u64 param2, u64 param3, u64 param4);
+extern int perform_tracing_exit(u64 syscall, long ret);
+extern int sys_read_strace_hist(struct exec_context *current, int syscall_num, char *buff);
+extern int sys_read_strace_counts(struct exec_context *current, char *buff);
 
 
 
@@ -68,11 +300,13 @@ extern int perform_tracing(u64 syscall, u64 param1, u64 param2, u64 param3, u64
 //////////////////////// ftrace functionality ///////////////////////// 
 ///////////////////////////////////////////////////////////////////////
 
-#define FTRACE_MAX 16
 #define MAX_ARGS 5
 #define PUSH_RBP_OPCODE 0x55
 #define INV_OPCODE 0xFF 
 #define END_ADDR 0x10000003B
+#define FTRACE_PATCH_LEN 4	// push %rbp; mov %rsp,%rbp replaced by INV_OPCODEs
+#define FTRACE_BT_DEPTH 8	// ENABLE_BACKTRACE depth when nargs is 0
+#define FTRACE_BT_MAX 12	// keeps stack records below 128 bytes, see STRACE_REC_COMPACT
 
 //Commands
 enum{
@@ -82,6 +316,10 @@ enum{
 	       DISABLE_FTRACE,
 	       ENABLE_BACKTRACE,
 	       DISABLE_BACKTRACE,
+	       ENABLE_FTRACE_EXIT,
+	       DISABLE_FTRACE_EXIT,
+	       SAMPLE_FTRACE,	// nargs: record 1 in nargs calls
+	       RATE_FTRACE,	// nargs: trace_limit rate
 	       MAX_FTRACE
 };
   
@@ -91,13 +329,82 @@ struct ftrace_info{
 		 u32 num_args;
 		 int fd;
 		 int capture_backtrace;
-                 struct ftrace_info *next;               		 
+		 u32 bt_depth;
+		 int trace_exit;	// hook the return address, see ftrace_shadow
+		 int enabled;	// code at faddr is patched
+		 struct trace_limit limit;
+		 u64 hits;
+		 u64 cycles;	// spent in handle_ftrace_fault() for this function
+};
+
+//Per-function overhead returned by sys_read_ftrace_stats()
+struct ftrace_stats{
+	u64 hits;	// calls that entered handle_ftrace_fault()
+	u64 cycles;	// spent there in total
+};
+
+//Every ftrace record starts with this header, followed by the function
+//address and num_args u64 arguments; 'len' covers the whole record.
+//With FTRACE_REC_STACK set the record instead defines stack 'stack_id'
+//as num_args return addresses, innermost first; it precedes the first
+//record of its buffer that refers to the stack. Once overwritten or
+//dropped it is pushed again, so in a TRACE_BUFFER_OVERWRITE buffer a
+//few records may come before the definition of their stack.
+struct ftrace_rec_hdr{
+	u16 len;
+	u16 flags;
+	u16 num_args;
+	u16 stack_id;	// 0 if no backtrace was taken
+};
+
+// ftrace_rec_hdr flags
+#define FTRACE_REC_STACK (1 << 0)
+#define FTRACE_REC_EXIT  (1 << 1)	// args: return value, duration in cycles
+
+#define FTRACE_REC_MAX (sizeof(struct ftrace_rec_hdr) + FTRACE_BT_MAX * sizeof(u64))
+
+//Each unique backtrace is kept once, in a table of FTRACE_STACK_SLOTS
+//slots indexed by hash; its id is the slot number + 1
+struct ftrace_stack{
+	u64 hash;
+	u16 depth;
+	// where the FTRACE_REC_STACK record went: buffer id (0 if none yet),
+	// ring, its offset and the ring's dropped count at the time
+	u16 emit_ring;
+	u32 emit_pos;
+	u64 emit_tb;
+	u64 emit_dropped;
+	u64 frames[FTRACE_BT_MAX];
+};
+
+#define FTRACE_STACK_SLOTS (TRACE_BUFFER_PAGE_SIZE / sizeof(struct ftrace_stack *))
+
+//With ENABLE_FTRACE_EXIT the return address of a traced call is replaced
+//by the trampoline, a user page of INV_OPCODEs, and saved on this shadow
+//stack until the call returns into the trampoline
+struct ftrace_shadow{
+	u64 ret;	// the real return address
+	u64 slot;	// user stack address it was taken from
+	u64 faddr;
+	u64 entry_ts;
 };
 
+#define FTRACE_SHADOW_MAX (TRACE_BUFFER_PAGE_SIZE / sizeof(struct ftrace_shadow))
+
+//Open addressing table of ftrace_info pointers keyed by faddr; the slots
+//are spread over whole pages, FTRACE_SLOTS_PER_PAGE to a page
+#define FTRACE_SLOTS_PER_PAGE (TRACE_BUFFER_PAGE_SIZE / sizeof(struct ftrace_info *))
+
 struct ftrace_head{
 	         long count;  
-                 struct ftrace_info *next;               		 
-                 struct ftrace_info *last;   		 
+		 u32 tombs;	// slots of removed entries
+		 u32 nslots;	// power of two, a multiple of FTRACE_SLOTS_PER_PAGE
+		 struct ftrace_info ***pages;
+		 u32 nstacks;
+		 struct ftrace_stack **stacks;	// FTRACE_STACK_SLOTS or NULL
+		 u64 tramp_addr;	// user address of the trampoline, 0 until needed
+		 u32 shadow_top;
+		 struct ftrace_shadow *shadow;	// FTRACE_SHADOW_MAX entries or NULL
 };
 
 struct user_regs;
@@ -105,6 +412,7 @@ struct user_regs;
 extern long do_ftrace(struct exec_context *current, unsigned long faddr, long action, long nargs, int fd_trace_buffer);
 extern long handle_ftrace_fault(struct user_regs *regs);
 extern int sys_read_ftrace(struct file *filep, char *buff, u64 count);
+extern int sys_read_ftrace_stats(struct exec_context *current, unsigned long faddr, char *buff);
 
 
 #endif